@@ -0,0 +1,331 @@
+/* Compiler and loader of pre-compiled command traces
+ *
+ * Identical lines are interned, so that the loader tokenizes each only
+ * once, and runs of the same line become a single instruction.
+ */
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+
+#define BC_MAGIC "QBIN"
+#define BC_VERSION 1
+
+static void put_varint(FILE *f, uint64_t v)
+{
+    while (v >= 0x80) {
+        fputc((v & 0x7f) | 0x80, f);
+        v >>= 7;
+    }
+    fputc(v, f);
+}
+
+/* Decode varint at *pp, not reading past end */
+static bool get_varint(const uint8_t **pp, const uint8_t *end, uint64_t *v)
+{
+    *v = 0;
+    for (int shift = 0; shift < 64 && *pp < end; shift += 7) {
+        uint8_t c = *(*pp)++;
+        *v |= (uint64_t) (c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return true;
+    }
+    return false;
+}
+
+/* Interning of lines by open addressing */
+typedef struct {
+    char **text;
+    size_t *len;
+    int cnt;
+    int *slots; /* Index of line + 1, or 0 when empty */
+    int nslots;
+} intern_t;
+
+static uint32_t hash_line(const char *s, size_t len)
+{
+    /* FNV-1a */
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (uint8_t) s[i]) * 16777619u;
+    return h;
+}
+
+/* Double the table.  Return false, with the table as it was, when out of
+ * memory
+ */
+static bool intern_grow(intern_t *in)
+{
+    int nslots = in->nslots ? in->nslots * 2 : 1024;
+    int *slots = calloc(nslots, sizeof(int));
+    char **text = realloc(in->text, nslots / 2 * sizeof(char *));
+    if (text)
+        in->text = text;
+    size_t *len = realloc(in->len, nslots / 2 * sizeof(size_t));
+    if (len)
+        in->len = len;
+    if (!slots || !text || !len) {
+        free(slots);
+        return false;
+    }
+
+    for (int i = 0; i < in->nslots; i++) {
+        int id = in->slots[i];
+        if (!id)
+            continue;
+        uint32_t h = hash_line(in->text[id - 1], in->len[id - 1]);
+        int j = h & (nslots - 1);
+        while (slots[j])
+            j = (j + 1) & (nslots - 1);
+        slots[j] = id;
+    }
+    free(in->slots);
+    in->slots = slots;
+    in->nslots = nslots;
+    return true;
+}
+
+/* Index of line s, added if new, or -1 when out of memory */
+static int intern(intern_t *in, const char *s, size_t len)
+{
+    if (in->cnt >= in->nslots / 2 && !intern_grow(in))
+        return -1;
+
+    int j = hash_line(s, len) & (in->nslots - 1);
+    for (int id; (id = in->slots[j]); j = (j + 1) & (in->nslots - 1)) {
+        if (in->len[id - 1] == len && !memcmp(in->text[id - 1], s, len))
+            return id - 1;
+    }
+    char *copy = malloc(len);
+    if (!copy)
+        return -1;
+    memcpy(copy, s, len);
+    in->text[in->cnt] = copy;
+    in->len[in->cnt] = len;
+    in->slots[j] = ++in->cnt;
+    return in->cnt - 1;
+}
+
+bool bc_compile(const char *infile, const char *outfile, size_t max_line)
+{
+    FILE *in = infile ? fopen(infile, "r") : stdin;
+    if (!in) {
+        fprintf(stderr, "Could not open source file '%s'\n", infile);
+        return false;
+    }
+
+    intern_t lines = {0};
+    bc_insn_t *insns = NULL;
+    int insn_cnt = 0, insn_max = 0;
+    char *buf = malloc(max_line + 1);
+    bool ok = buf != NULL;
+    size_t len = 0;
+    int c;
+    do {
+        c = ok ? getc(in) : EOF;
+        if (c != EOF)
+            buf[len++] = c;
+        /* Terminate line as the text reader does */
+        if (len && (c == EOF || c == '\n' || len == max_line)) {
+            if (buf[len - 1] != '\n')
+                buf[len++] = '\n';
+            int id = intern(&lines, buf, len);
+            len = 0;
+            if (id < 0) {
+                ok = false;
+                break;
+            }
+            if (insn_cnt && insns[insn_cnt - 1].line == id) {
+                insns[insn_cnt - 1].repeat++;
+                continue;
+            }
+            if (insn_cnt == insn_max) {
+                int max = insn_max ? insn_max * 2 : 1024;
+                bc_insn_t *more = realloc(insns, max * sizeof(bc_insn_t));
+                if (!more) {
+                    ok = false;
+                    break;
+                }
+                insns = more;
+                insn_max = max;
+            }
+            insns[insn_cnt++] = (bc_insn_t){.line = id, .repeat = 1};
+        }
+    } while (c != EOF);
+    if (infile)
+        fclose(in);
+    if (!ok)
+        fprintf(stderr, "Out of memory compiling '%s'\n",
+                infile ? infile : "stdin");
+
+    FILE *out = ok ? fopen(outfile, "wb") : NULL;
+    if (ok && !out) {
+        fprintf(stderr, "Could not write compiled trace '%s'\n", outfile);
+        ok = false;
+    }
+    if (out) {
+        fwrite(BC_MAGIC, 1, strlen(BC_MAGIC), out);
+        fputc(BC_VERSION, out);
+        put_varint(out, lines.cnt);
+        for (int i = 0; i < lines.cnt; i++) {
+            put_varint(out, lines.len[i]);
+            fwrite(lines.text[i], 1, lines.len[i], out);
+        }
+        for (int i = 0; i < insn_cnt; i++) {
+            put_varint(out, insns[i].line);
+            put_varint(out, insns[i].repeat);
+        }
+        ok = !ferror(out);
+        ok = fclose(out) == 0 && ok;
+        if (!ok)
+            fprintf(stderr, "Could not write compiled trace '%s'\n", outfile);
+    }
+
+    for (int i = 0; i < lines.cnt; i++)
+        free(lines.text[i]);
+    free(lines.text);
+    free(lines.len);
+    free(lines.slots);
+    free(insns);
+    free(buf);
+    return ok;
+}
+
+bool bc_is_compiled(const char *fname)
+{
+    char magic[sizeof(BC_MAGIC)] = "";
+    FILE *f = fname ? fopen(fname, "rb") : NULL;
+    if (!f)
+        return false;
+    size_t n = fread(magic, 1, strlen(BC_MAGIC), f);
+    fclose(f);
+    return n == strlen(BC_MAGIC) && !memcmp(magic, BC_MAGIC, n);
+}
+
+/* Split line into tokens at white space, as the text parser does.  Return
+ * false when out of memory
+ */
+static bool tokenize(bc_line_t *l, size_t len)
+{
+    l->tokens = malloc(len + 1);
+    l->offsets = malloc((len / 2 + 1) * sizeof(int));
+    l->argc = 0;
+    if (!l->tokens || !l->offsets)
+        return false;
+
+    char *dst = l->tokens;
+    bool skipping = true;
+    for (size_t i = 0; i < len; i++) {
+        char c = l->text[i];
+        if (isspace((unsigned char) c)) {
+            if (!skipping)
+                *dst++ = '\0';
+            skipping = true;
+        } else {
+            if (skipping)
+                l->offsets[l->argc++] = dst - l->tokens;
+            skipping = false;
+            *dst++ = c;
+        }
+    }
+    if (!skipping)
+        *dst++ = '\0';
+    l->tok_len = dst - l->tokens;
+    return true;
+}
+
+bc_program_t *bc_load(const char *fname)
+{
+    FILE *f = fopen(fname, "rb");
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    rewind(f);
+    uint8_t *data = malloc(size > 0 ? size : 1);
+    bc_program_t *prog = calloc(1, sizeof(bc_program_t));
+    bool ok = data && prog && size > 0 &&
+              fread(data, 1, size, f) == (size_t) size;
+    fclose(f);
+
+    const uint8_t *p = data, *end = data + size;
+    size_t magic_len = strlen(BC_MAGIC);
+    ok = ok && size > magic_len && !memcmp(p, BC_MAGIC, magic_len) &&
+         p[magic_len] == BC_VERSION;
+    p += magic_len + 1;
+
+    uint64_t cnt = 0;
+    ok = ok && get_varint(&p, end, &cnt) && cnt <= (uint64_t) size;
+    if (ok) {
+        prog->lines = calloc(cnt, sizeof(bc_line_t));
+        prog->line_cnt = prog->lines ? cnt : 0;
+        ok = prog->lines || !cnt;
+    }
+    for (int i = 0; ok && i < prog->line_cnt; i++) {
+        bc_line_t *l = &prog->lines[i];
+        uint64_t len;
+        ok = get_varint(&p, end, &len) && len <= (uint64_t) (end - p);
+        if (!ok)
+            break;
+        l->text = malloc(len + 1);
+        if (!l->text) {
+            ok = false;
+            break;
+        }
+        memcpy(l->text, p, len);
+        l->text[len] = '\0';
+        p += len;
+        if (!(ok = tokenize(l, len)))
+            break;
+        if (l->argc > prog->max_argc)
+            prog->max_argc = l->argc;
+        if (l->tok_len > prog->max_tok_len)
+            prog->max_tok_len = l->tok_len;
+    }
+
+    int insn_max = 0;
+    while (ok && p < end) {
+        uint64_t line, repeat;
+        ok = get_varint(&p, end, &line) && get_varint(&p, end, &repeat) &&
+             line < (uint64_t) prog->line_cnt && repeat <= INT32_MAX;
+        if (!ok)
+            break;
+        if (prog->insn_cnt == insn_max) {
+            int max = insn_max ? insn_max * 2 : 1024;
+            bc_insn_t *more = realloc(prog->insns, max * sizeof(bc_insn_t));
+            if (!more) {
+                ok = false;
+                break;
+            }
+            prog->insns = more;
+            insn_max = max;
+        }
+        prog->insns[prog->insn_cnt++] =
+            (bc_insn_t){.line = line, .repeat = repeat};
+    }
+
+    free(data);
+    if (!ok) {
+        bc_free(prog);
+        return NULL;
+    }
+    return prog;
+}
+
+void bc_free(bc_program_t *prog)
+{
+    if (!prog)
+        return;
+    for (int i = 0; i < prog->line_cnt; i++) {
+        free(prog->lines[i].text);
+        free(prog->lines[i].offsets);
+        free(prog->lines[i].tokens);
+    }
+    free(prog->lines);
+    free(prog->insns);
+    free(prog);
+}
@@ -0,0 +1,51 @@
+#ifndef LAB0_BYTECODE_H
+#define LAB0_BYTECODE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Pre-compiled command traces for fast replay.
+ *
+ * A compiled file starts with the magic "QBIN" and a version byte, then
+ * holds the number of distinct lines and each line as length and text,
+ * all lengths as LEB128 varints.  The rest are instructions, each the
+ * index of a line and how many times in a row it is executed.
+ */
+
+typedef struct {
+    char *text;     /* Line as read from trace, with newline */
+    int argc;       /* Number of tokens */
+    int *offsets;   /* Start of each token within tokens */
+    char *tokens;   /* Null-terminated tokens, back to back */
+    size_t tok_len; /* Bytes in tokens */
+    void *cmd;      /* For the interpreter to resolve commands once */
+} bc_line_t;
+
+typedef struct {
+    int line;
+    int repeat;
+} bc_insn_t;
+
+typedef struct {
+    bc_line_t *lines;
+    int line_cnt;
+    bc_insn_t *insns;
+    int insn_cnt;
+    int max_argc;
+    size_t max_tok_len;
+} bc_program_t;
+
+/* Compile text trace infile (stdin if NULL) into outfile.  Lines longer
+ * than max_line characters are split, as the text reader does.
+ */
+bool bc_compile(const char *infile, const char *outfile, size_t max_line);
+
+/* Does file start with the magic of a compiled trace? */
+bool bc_is_compiled(const char *fname);
+
+/* Load compiled trace.  Return NULL if missing or malformed */
+bc_program_t *bc_load(const char *fname);
+
+void bc_free(bc_program_t *prog);
+
+#endif /* LAB0_BYTECODE_H */
@@ -0,0 +1,85 @@
+/* Empirical complexity estimation
+ *
+ * Each model f(n) is fitted as t = c * f(n), minimizing the error relative
+ * to every measurement, so that small sizes weigh as much as large ones.
+ * The model with the smallest RMS relative error wins.
+ */
+
+#include <math.h>
+
+#include "complexity.h"
+
+static const char *big_o_names[N_BIG_O] = {
+    "O(1)", "O(log n)", "O(n)", "O(n log n)", "O(n^2)",
+};
+
+const char *big_o_name(big_o_t model)
+{
+    return model < N_BIG_O ? big_o_names[model] : "?";
+}
+
+static double big_o_eval(big_o_t model, double n)
+{
+    switch (model) {
+    case BIG_O_1:
+        return 1;
+    case BIG_O_LOG_N:
+        return log2(n);
+    case BIG_O_N:
+        return n;
+    case BIG_O_N_LOG_N:
+        return n * log2(n);
+    default:
+        return n * n;
+    }
+}
+
+double big_o_growth(big_o_t model, double from, double to)
+{
+    return big_o_eval(model, to) / big_o_eval(model, from);
+}
+
+/* RMS relative error of best fit t = c * f(n) */
+static double big_o_error(big_o_t model,
+                          const double *sizes,
+                          const double *times,
+                          int cnt)
+{
+    /* With r = f(n) / t, minimizing sum (1 - c * r)^2 gives c below */
+    double sum_r = 0, sum_r2 = 0;
+    for (int i = 0; i < cnt; i++) {
+        double r = big_o_eval(model, sizes[i]) / times[i];
+        sum_r += r;
+        sum_r2 += r * r;
+    }
+    double c = sum_r / sum_r2;
+
+    double err = 0;
+    for (int i = 0; i < cnt; i++) {
+        double e = 1 - c * big_o_eval(model, sizes[i]) / times[i];
+        err += e * e;
+    }
+    return sqrt(err / cnt);
+}
+
+big_o_t big_o_fit(const double *sizes,
+                  const double *times,
+                  int cnt,
+                  double *confidence)
+{
+    big_o_t best = BIG_O_1;
+    double err[N_BIG_O];
+    for (big_o_t model = 0; model < N_BIG_O; model++) {
+        err[model] = big_o_error(model, sizes, times, cnt);
+        if (err[model] < err[best])
+            best = model;
+    }
+
+    double second = INFINITY;
+    for (big_o_t model = 0; model < N_BIG_O; model++) {
+        if (model != best && err[model] < second)
+            second = err[model];
+    }
+    *confidence = second > 0 ? 1 - err[best] / second : 0;
+    return best;
+}
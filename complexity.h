@@ -0,0 +1,30 @@
+#ifndef LAB0_COMPLEXITY_H
+#define LAB0_COMPLEXITY_H
+
+/* Fit measured running times to asymptotic cost models */
+
+typedef enum {
+    BIG_O_1,
+    BIG_O_LOG_N,
+    BIG_O_N,
+    BIG_O_N_LOG_N,
+    BIG_O_N2,
+    N_BIG_O,
+} big_o_t;
+
+/* Printable name of model, e.g. "O(n log n)" */
+const char *big_o_name(big_o_t model);
+
+/* How many times the cost of model grows from size 'from' to size 'to' */
+double big_o_growth(big_o_t model, double from, double to);
+
+/* Find the model best describing times[i] measured at sizes[i].
+ * Store in *confidence how much better it fits than the runner-up,
+ * from 0 (no better) to 1 (exact fit).
+ */
+big_o_t big_o_fit(const double *sizes,
+                  const double *times,
+                  int cnt,
+                  double *confidence);
+
+#endif /* LAB0_COMPLEXITY_H */
@@ -1,18 +1,27 @@
 /* Implementation of simple command-line interface */
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "bytecode.h"
 #include "console.h"
+#include "perfctr.h"
+#include "record.h"
 #include "report.h"
+#include "timing.h"
 #include "web.h"
 
 /* Some global values */
@@ -20,6 +29,14 @@ int simulation = 0;
 int show_entropy = 0;
 static cmd_element_t *cmd_list = NULL;
 static param_element_t *param_list = NULL;
+
+/* Parameter value substituted while a particular command executes */
+typedef struct __param_override {
+    param_element_t *param;
+    int value;
+    int saved;
+    struct __param_override *next;
+} param_override_t;
 static bool block_flag = false;
 static bool prompt_flag = true;
 
@@ -31,20 +48,26 @@ static double first_time, last_time;
 
 /* Implement buffered I/O using variant of RIO package from CS:APP
  * Must create stack of buffers to handle I/O with nested source commands.
+ * Regular files are memory-mapped whole, other input is read in large
+ * chunks.  Either way, lines are found with memchr and used in place.
  */
 
-#define RIO_BUFSIZE 8192
+#define RIO_BUFSIZE (1 << 16)
 
 typedef struct __rio {
-    int fd;                /* File descriptor */
-    int count;             /* Unread bytes in internal buffer */
-    char *bufptr;          /* Next unread byte in internal buffer */
-    char buf[RIO_BUFSIZE]; /* Internal buffer */
-    struct __rio *prev;    /* Next element in stack */
+    int fd;             /* File descriptor */
+    bool tty;           /* Interactive input, read with linenoise */
+    bool mapped;        /* buf maps the whole file */
+    bool eof;           /* Nothing left to read into buf */
+    char *buf;          /* Mapped file or internal buffer */
+    size_t count;       /* Unread bytes in buf */
+    char *bufptr;       /* Next unread byte in buf */
+    struct __rio *prev; /* Next element in stack */
 } rio_t;
 
 static rio_t *buf_stack;
-static char linebuf[RIO_BUFSIZE];
+/* Copy of line being echoed, terminated like readline used to */
+static char linebuf[CMD_MAXLINE + 2];
 
 /* Maximum file descriptor */
 static int fd_max = 0;
@@ -53,6 +76,8 @@ static int fd_max = 0;
 static int err_limit = 5;
 static int err_cnt = 0;
 static int echo = 0;
+static int bench_json = 0;
+static int perf_mode = 0;
 
 static bool quit_flag = false;
 static char *prompt = "cmd> ";
@@ -65,12 +90,58 @@ static bool has_infile = false;
 static cmd_func_t quit_helpers[MAXQUIT];
 static int quit_helper_cnt = 0;
 
+/* Functions to call around each command */
+#define MAXHOOK 8
+static pre_cmd_func_t pre_hooks[MAXHOOK];
+static post_cmd_func_t post_hooks[MAXHOOK];
+static int hook_cnt = 0;
+
 static void init_in();
 
 static bool push_file(char *fname);
 static void pop_file();
 
 static bool interpret_cmda(int argc, char *argv[]);
+static bool capture_line(int argc, char *argv[]);
+static bool run_macro(const char *name, bool *found);
+
+/* Commands and parameters are also indexed by name, in hash tables with
+ * linear probing.  The lists keep them sorted for 'help' and 'option'.
+ */
+#define HASH_SLOTS 256
+static cmd_element_t *cmd_table[HASH_SLOTS];
+static param_element_t *param_table[HASH_SLOTS];
+static int cmd_cnt = 0, param_cnt = 0;
+
+static unsigned hash_name(const char *name, size_t len)
+{
+    /* FNV-1a */
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char) name[i]) * 16777619u;
+    return h & (HASH_SLOTS - 1);
+}
+
+static cmd_element_t *find_cmd(const char *name, size_t len)
+{
+    for (unsigned i = hash_name(name, len); cmd_table[i];
+         i = (i + 1) & (HASH_SLOTS - 1)) {
+        cmd_element_t *cmd = cmd_table[i];
+        if (!strncmp(name, cmd->name, len) && cmd->name[len] == '\0')
+            return cmd;
+    }
+    return NULL;
+}
+
+static param_element_t *find_param(const char *name)
+{
+    for (unsigned i = hash_name(name, strlen(name)); param_table[i];
+         i = (i + 1) & (HASH_SLOTS - 1)) {
+        if (!strcmp(name, param_table[i]->name))
+            return param_table[i];
+    }
+    return NULL;
+}
 
 /* Add a new command */
 void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
@@ -87,8 +158,18 @@ void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
     cmd->operation = operation;
     cmd->summary = summary;
     cmd->param = param;
+    cmd->overrides = NULL;
+    cmd->id = cmd_cnt;
     cmd->next = next_cmd;
     *last_loc = cmd;
+
+    /* Keep table at most half full */
+    if (++cmd_cnt > HASH_SLOTS / 2)
+        report_event(MSG_FATAL, "Exceeded limit on commands");
+    unsigned i = hash_name(name, strlen(name));
+    while (cmd_table[i])
+        i = (i + 1) & (HASH_SLOTS - 1);
+    cmd_table[i] = cmd;
 }
 
 /* Add a new parameter */
@@ -109,27 +190,121 @@ void add_param(char *name, int *valp, char *summary, setter_func_t setter)
     param->setter = setter;
     param->next = next_param;
     *last_loc = param;
+
+    if (++param_cnt > HASH_SLOTS / 2)
+        report_event(MSG_FATAL, "Exceeded limit on parameters");
+    unsigned i = hash_name(name, strlen(name));
+    while (param_table[i])
+        i = (i + 1) & (HASH_SLOTS - 1);
+    param_table[i] = param;
 }
 
-/* Parse a string into a command line */
-static char **parse_args(char *line, int *argcp)
+/* Override value of parameter whenever the named command executes */
+bool set_cmd_param(char *cmd_name, char *param_name, int value)
 {
-    /* Must first determine how many arguments there are.
-     * Replace all white space with null characters
-     */
-    size_t len = strlen(line);
+    cmd_element_t *cmd = find_cmd(cmd_name, strlen(cmd_name));
+    param_element_t *param = find_param(param_name);
+    if (!cmd || !param)
+        return false;
 
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
-    buf[len] = '\0';
+    param_override_t *ovr = cmd->overrides;
+    while (ovr && ovr->param != param)
+        ovr = ovr->next;
+    if (!ovr) {
+        ovr = malloc_or_fail(sizeof(param_override_t), "set_cmd_param");
+        ovr->param = param;
+        ovr->next = cmd->overrides;
+        cmd->overrides = ovr;
+    }
+    ovr->value = value;
+    return true;
+}
 
-    char *src = line;
-    char *dst = buf;
+static void set_param_value(param_element_t *param, int value)
+{
+    int oldval = *param->valp;
+    *param->valp = value;
+    if (param->setter)
+        param->setter(oldval);
+}
+
+/* Install per-command parameter values, remembering the global ones */
+static void apply_overrides(param_override_t *ovr)
+{
+    for (; ovr; ovr = ovr->next) {
+        ovr->saved = *ovr->param->valp;
+        set_param_value(ovr->param, ovr->value);
+    }
+}
+
+static void restore_overrides(param_override_t *ovr)
+{
+    for (; ovr; ovr = ovr->next)
+        set_param_value(ovr->param, ovr->saved);
+}
+
+/* Arguments of commands are carved from an arena and released after
+ * dispatch.  Commands such as 'replay' nest, so release is LIFO.
+ */
+#define ARENA_SIZE (4 * (CMD_MAXLINE + 2))
+static union {
+    char *align;
+    char bytes[ARENA_SIZE];
+} arena;
+static size_t arena_top = 0;
+
+/* Take bytes from arena, or NULL when it is full */
+static void *arena_alloc(size_t bytes)
+{
+    bytes = (bytes + sizeof(char *) - 1) & ~(sizeof(char *) - 1);
+    if (arena_top + bytes > ARENA_SIZE)
+        return NULL;
+    void *p = arena.bytes + arena_top;
+    arena_top += bytes;
+    return p;
+}
+
+/* Block for argc arguments followed by len bytes of words, from the arena
+ * if possible.  *sizep is set as for parse_args.
+ */
+static char **alloc_args(int argc, size_t len, size_t *sizep)
+{
+    size_t size = (argc + 1) * sizeof(char *) + len;
+    char **argv = arena_alloc(size);
+    *sizep = argv ? 0 : size;
+    if (!argv)
+        argv = malloc_or_fail(size, "alloc_args");
+    return argv;
+}
+
+/* Parse a string into a command line.  The argument array and the words
+ * share one block, from the arena if possible.  Otherwise it is allocated
+ * and its size stored in *sizep, which is 0 for arena blocks.
+ */
+static char **parse_args(const char *line,
+                         size_t len,
+                         int *argcp,
+                         size_t *sizep)
+{
+    /* Must first determine how many arguments there are */
+    const char *end = line + len;
     bool skipping = true;
-    int c;
     int argc = 0;
-    while ((c = *src++) != '\0') {
-        if (isspace(c)) {
+    for (const char *src = line; src < end; src++) {
+        bool space = isspace(*src);
+        if (skipping && !space)
+            argc++;
+        skipping = space;
+    }
+
+    char **argv = alloc_args(argc, len + 1, sizep);
+
+    /* Copy each word null-terminated after the array */
+    char *dst = (char *) (argv + argc + 1);
+    int i = 0;
+    skipping = true;
+    for (const char *src = line; src < end; src++) {
+        if (isspace(*src)) {
             if (!skipping) {
                 /* Hit end of word */
                 *dst++ = '\0';
@@ -138,26 +313,52 @@ static char **parse_args(char *line, int *argcp)
         } else {
             if (skipping) {
                 /* Hit start of new word */
-                argc++;
+                argv[i++] = dst;
                 skipping = false;
             }
-            *dst++ = c;
+            *dst++ = *src;
         }
     }
+    *dst = '\0';
+    argv[argc] = NULL;
 
-    /* Now assemble into array of strings */
-    char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
-    for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
-    }
-
-    free_block(buf, len + 1);
     *argcp = argc;
     return argv;
 }
 
+/* Script blocks.  'repeat N {' and 'define NAME {' capture the following
+ * lines up to the matching '}' as statements, which are split into words
+ * once and then run from memory as often as needed.
+ */
+typedef struct __stmt {
+    int argc;
+    char *words; /* argc null-terminated words */
+    size_t words_len;
+    cmd_element_t *cmd;   /* Resolved at capture, NULL for macros */
+    int repeat;           /* Iterations of block */
+    struct __stmt *block; /* Body of nested block, NULL for a command */
+    struct __stmt *next;
+} stmt_t;
+
+typedef struct __macro {
+    char *name;
+    stmt_t *body;
+    struct __macro *next;
+} macro_t;
+
+#define MAXNEST 16
+static struct {
+    int repeat;
+    char *macro; /* Name when defining a macro, else NULL */
+    stmt_t *head;
+    stmt_t **tail;
+} capture_stack[MAXNEST];
+static int capture_depth = 0;
+
+#define MAXMACRODEPTH 64
+static macro_t *macro_list = NULL;
+static int macro_depth = 0;
+
 static void record_error()
 {
     err_cnt++;
@@ -167,18 +368,49 @@ static void record_error()
     }
 }
 
-/* Execute a command that has already been split into arguments */
-static bool interpret_cmda(int argc, char *argv[])
+static int running_cmd = -1;
+
+int current_cmd_id()
+{
+    return running_cmd;
+}
+
+const char *cmd_name(int id)
+{
+    for (cmd_element_t *c = cmd_list; c; c = c->next) {
+        if (c->id == id)
+            return c->name;
+    }
+    return NULL;
+}
+
+/* Execute command found for argv[0], NULL when there is none */
+static bool execute_cmd(cmd_element_t *next_cmd, int argc, char *argv[])
 {
     if (argc == 0)
         return true;
-    /* Try to find matching command */
-    cmd_element_t *next_cmd = cmd_list;
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
     if (next_cmd) {
+        int outer_cmd = running_cmd;
+        running_cmd = next_cmd->id;
+        apply_overrides(next_cmd->overrides);
+        for (int i = 0; i < hook_cnt; i++) {
+            if (pre_hooks[i])
+                pre_hooks[i](argc, argv);
+        }
         ok = next_cmd->operation(argc, argv);
+        /* Unwind in reverse order so that hooks nest properly */
+        for (int i = hook_cnt - 1; i >= 0; i--) {
+            if (post_hooks[i])
+                ok = post_hooks[i](argc, argv, ok);
+        }
+        running_cmd = outer_cmd;
+        /* 'quit' has released commands and their overrides, so next_cmd
+         * must not be touched once the command list is gone.  Stopping on
+         * the error limit keeps the list, and the overrides are undone.
+         */
+        if (cmd_list)
+            restore_overrides(next_cmd->overrides);
         if (!ok)
             record_error();
     } else {
@@ -190,22 +422,258 @@ static bool interpret_cmda(int argc, char *argv[])
     return ok;
 }
 
-/* Execute a command from a command line */
-static bool interpret_cmd(char *cmdline)
+/* Execute a command that has already been split into arguments */
+static bool interpret_cmda(int argc, char *argv[])
+{
+    if (argc == 0)
+        return true;
+    cmd_element_t *cmd = find_cmd(argv[0], strlen(argv[0]));
+    if (!cmd) {
+        bool found;
+        bool ok = run_macro(argv[0], &found);
+        if (found)
+            return ok;
+    }
+    return execute_cmd(cmd, argc, argv);
+}
+
+/* Execute a command from len bytes of line, which need no terminator */
+static bool interpret_line(const char *line, size_t len)
 {
     if (quit_flag)
         return false;
 
     int argc;
-    char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
+    size_t mark = arena_top, size;
+    char **argv = parse_args(line, len, &argc, &size);
+    bool ok = capture_depth ? capture_line(argc, argv)
+                            : interpret_cmda(argc, argv);
+    if (size)
+        free_block(argv, size);
+    arena_top = mark;
+    /* Output is written once per command */
+    report_flush();
+
+    return ok;
+}
+
+/* Execute a command from a command line */
+static bool interpret_cmd(char *cmdline)
+{
+    return interpret_line(cmdline, strlen(cmdline));
+}
+
+static stmt_t *new_stmt(int argc, char *argv[])
+{
+    stmt_t *s = calloc_or_fail(1, sizeof(stmt_t), "new_stmt");
     for (int i = 0; i < argc; i++)
-        free_string(argv[i]);
-    free_array(argv, argc, sizeof(char *));
+        s->words_len += strlen(argv[i]) + 1;
+    s->words = malloc_or_fail(s->words_len, "new_stmt");
+    char *dst = s->words;
+    for (int i = 0; i < argc; i++) {
+        size_t len = strlen(argv[i]) + 1;
+        memcpy(dst, argv[i], len);
+        dst += len;
+    }
+    s->argc = argc;
+    s->cmd = argc ? find_cmd(argv[0], strlen(argv[0])) : NULL;
+    return s;
+}
+
+static void free_stmts(stmt_t *s)
+{
+    while (s) {
+        stmt_t *next = s->next;
+        free_stmts(s->block);
+        if (s->words)
+            free_block(s->words, s->words_len);
+        free_block(s, sizeof(stmt_t));
+        s = next;
+    }
+}
+
+static bool run_stmt(stmt_t *s);
+
+/* Run statements n times, stopping early on 'quit' */
+static bool run_block(stmt_t *head, int n)
+{
+    bool ok = true;
+    for (int r = 0; r < n; r++) {
+        for (stmt_t *s = head; s; s = s->next) {
+            ok = run_stmt(s) && ok;
+            /* 'quit' may have released the statements */
+            if (quit_flag)
+                return ok;
+        }
+    }
+    return ok;
+}
 
+static bool run_stmt(stmt_t *s)
+{
+    if (s->block)
+        return run_block(s->block, s->repeat);
+
+    /* Commands may modify their arguments, so each run gets a fresh copy */
+    size_t mark = arena_top, size;
+    char **argv = alloc_args(s->argc, s->words_len, &size);
+    char *words = (char *) (argv + s->argc + 1);
+    memcpy(words, s->words, s->words_len);
+    for (int i = 0; i < s->argc; i++) {
+        argv[i] = words;
+        words += strlen(words) + 1;
+    }
+    argv[s->argc] = NULL;
+
+    bool ok = s->cmd ? execute_cmd(s->cmd, s->argc, argv)
+                     : interpret_cmda(s->argc, argv);
+    if (size)
+        free_block(argv, size);
+    arena_top = mark;
     return ok;
 }
 
+static macro_t *find_macro(const char *name)
+{
+    macro_t *m = macro_list;
+    while (m && strcmp(m->name, name))
+        m = m->next;
+    return m;
+}
+
+/* Run macro, setting *found to whether it exists */
+static bool run_macro(const char *name, bool *found)
+{
+    macro_t *m = find_macro(name);
+    *found = m != NULL;
+    if (!m)
+        return false;
+    if (macro_depth >= MAXMACRODEPTH) {
+        report(1, "Macro '%s' nested more than %d deep", name,
+               MAXMACRODEPTH);
+        record_error();
+        return false;
+    }
+    macro_depth++;
+    bool ok = run_block(m->body, 1);
+    macro_depth--;
+    return ok;
+}
+
+/* Start capturing block.  Takes ownership of macro */
+static bool begin_block(int repeat, char *macro)
+{
+    if (capture_depth == MAXNEST) {
+        report(1, "Blocks nested more than %d deep", MAXNEST);
+        if (macro)
+            free_string(macro);
+        return false;
+    }
+    capture_stack[capture_depth].repeat = repeat;
+    capture_stack[capture_depth].macro = macro;
+    capture_stack[capture_depth].head = NULL;
+    capture_stack[capture_depth].tail = &capture_stack[capture_depth].head;
+    capture_depth++;
+    return true;
+}
+
+static void append_stmt(stmt_t *s)
+{
+    *capture_stack[capture_depth - 1].tail = s;
+    capture_stack[capture_depth - 1].tail = &s->next;
+}
+
+/* Close innermost block.  Outermost 'repeat' blocks run right away */
+static bool end_block()
+{
+    capture_depth--;
+    int repeat = capture_stack[capture_depth].repeat;
+    char *name = capture_stack[capture_depth].macro;
+    stmt_t *head = capture_stack[capture_depth].head;
+
+    if (capture_depth) {
+        stmt_t *s = calloc_or_fail(1, sizeof(stmt_t), "end_block");
+        s->repeat = repeat;
+        s->block = head;
+        append_stmt(s);
+        return true;
+    }
+
+    if (name) {
+        macro_t *m = find_macro(name);
+        if (m) {
+            free_stmts(m->body);
+            free_string(name);
+        } else {
+            m = malloc_or_fail(sizeof(macro_t), "end_block");
+            m->name = name;
+            m->next = macro_list;
+            macro_list = m;
+        }
+        m->body = head;
+        return true;
+    }
+
+    bool ok = run_block(head, repeat);
+    free_stmts(head);
+    return ok;
+}
+
+/* Parse repetition count of 'repeat' */
+static bool get_repeat(char *arg, int *np)
+{
+    if (!get_int(arg, np) || *np < 0) {
+        report(1, "Invalid repetition count '%s'", arg);
+        return false;
+    }
+    return true;
+}
+
+/* Add line to block being captured */
+static bool capture_line(int argc, char *argv[])
+{
+    if (argc == 0)
+        return true;
+
+    if (!strcmp(argv[0], "}"))
+        return end_block();
+
+    if (!strcmp(argv[0], "define")) {
+        report(1, "Cannot define macro inside block");
+        record_error();
+        return false;
+    }
+
+    if (argc == 3 && !strcmp(argv[0], "repeat") && !strcmp(argv[2], "{")) {
+        int n;
+        bool ok = get_repeat(argv[1], &n);
+        if (!ok) {
+            /* Capture anyway, so that its '}' still matches */
+            n = 0;
+            record_error();
+        }
+        if (!begin_block(n, NULL)) {
+            record_error();
+            return false;
+        }
+        return ok;
+    }
+
+    append_stmt(new_stmt(argc, argv));
+    return true;
+}
+
+/* Discard blocks still being captured */
+static void drop_blocks()
+{
+    while (capture_depth) {
+        capture_depth--;
+        free_stmts(capture_stack[capture_depth].head);
+        if (capture_stack[capture_depth].macro)
+            free_string(capture_stack[capture_depth].macro);
+    }
+}
+
 /* Set function to be executed as part of program exit */
 void add_quit_helper(cmd_func_t qf)
 {
@@ -215,6 +683,304 @@ void add_quit_helper(cmd_func_t qf)
         report_event(MSG_FATAL, "Exceeded limit on quit helpers");
 }
 
+/* Performance counters around each command, when enabled by 'option perf'.
+ * Commands may nest, e.g. 'time sort', so keep a small stack of readings.
+ */
+#define MAXDEPTH 8
+static struct {
+    bool valid;
+    int64_t start_ns;
+    perf_sample_t sample;
+} perf_stack[MAXDEPTH];
+static int perf_depth = 0;
+static bool perf_hw = false;
+
+/* Totals for each command name, reported at quit */
+typedef struct __perf_total {
+    char *name;
+    int calls;
+    int64_t ns;
+    uint64_t counts[N_PERF];
+    double counted; /* Least part of a call that the counters ran */
+    struct __perf_total *next;
+} perf_total_t;
+static perf_total_t *perf_totals = NULL;
+
+static void perf_setter(int oldval)
+{
+    if (perf_mode && !oldval) {
+        perf_hw = perf_open();
+        if (!perf_hw)
+            report(1,
+                   "Warning: Hardware performance counters unavailable, "
+                   "reporting time only");
+    } else if (!perf_mode && oldval) {
+        perf_close();
+        perf_hw = false;
+    }
+}
+
+/* Format time and counters into buf.  Counts that were scaled up because
+ * the counters ran for only part of the time are flagged.
+ */
+static void perf_format(char *buf,
+                        size_t size,
+                        int64_t ns,
+                        const uint64_t counts[N_PERF],
+                        double counted)
+{
+    int len = snprintf(buf, size, "%.3f ms", ns * 1e-6);
+    for (perf_counter_t ctr = 0; perf_hw && ctr < N_PERF; ctr++) {
+        if (perf_has(ctr) && len < size)
+            len += snprintf(buf + len, size - len, ", %lu %s",
+                            (unsigned long) counts[ctr], perf_name(ctr));
+    }
+    if (perf_hw && perf_has(PERF_CYCLES) && perf_has(PERF_INSTRUCTIONS) &&
+        counts[PERF_CYCLES] && len < size)
+        len += snprintf(buf + len, size - len, ", IPC %.2f",
+                        (double) counts[PERF_INSTRUCTIONS] /
+                            counts[PERF_CYCLES]);
+    if (perf_hw && counted < 1.0 && len < size)
+        snprintf(buf + len, size - len, " (scaled, counted %.0f%% of time)",
+                 counted * 100);
+}
+
+static void perf_pre_cmd(int argc, char *argv[])
+{
+    if (perf_depth < MAXDEPTH) {
+        perf_stack[perf_depth].valid = perf_mode;
+        if (perf_mode) {
+            perf_read(&perf_stack[perf_depth].sample);
+            perf_stack[perf_depth].start_ns = time_ns();
+        }
+    }
+    perf_depth++;
+}
+
+static bool perf_post_cmd(int argc, char *argv[], bool ok)
+{
+    if (--perf_depth >= MAXDEPTH || !perf_stack[perf_depth].valid ||
+        !perf_mode)
+        return ok;
+
+    int64_t ns = time_ns() - perf_stack[perf_depth].start_ns;
+    perf_sample_t sample;
+    uint64_t counts[N_PERF];
+    perf_read(&sample);
+    double counted =
+        perf_delta(&perf_stack[perf_depth].sample, &sample, counts);
+
+    char buf[256];
+    perf_format(buf, sizeof(buf), ns, counts, counted);
+    report(1, "Perf '%s': %s", argv[0], buf);
+
+    /* Append, so that totals come out in order of first use */
+    perf_total_t **tp = &perf_totals;
+    while (*tp && strcmp((*tp)->name, argv[0]) != 0)
+        tp = &(*tp)->next;
+    if (!*tp) {
+        *tp = calloc_or_fail(1, sizeof(perf_total_t), "perf_post_cmd");
+        (*tp)->name = strsave_or_fail(argv[0], "perf_post_cmd");
+        (*tp)->counted = 1.0;
+    }
+    perf_total_t *t = *tp;
+    t->calls++;
+    t->ns += ns;
+    if (counted < t->counted)
+        t->counted = counted;
+    for (int i = 0; i < N_PERF; i++)
+        t->counts[i] += counts[i];
+    return ok;
+}
+
+/* Report and release totals gathered for each command */
+static void perf_report_totals()
+{
+    if (perf_totals)
+        report(1, "Perf totals:");
+    while (perf_totals) {
+        perf_total_t *t = perf_totals;
+        char buf[256];
+        perf_format(buf, sizeof(buf), t->ns, t->counts, t->counted);
+        report(1, "  %-12s%6d calls | %s", t->name, t->calls, buf);
+        perf_totals = t->next;
+        free_string(t->name);
+        free_block(t, sizeof(perf_total_t));
+    }
+    perf_close();
+    perf_hw = false;
+    perf_mode = 0;
+}
+
+/* Recording of top-level commands, see record.h for the format */
+static rec_file_t *rec_out = NULL;
+static int64_t rec_start_ns;
+static int64_t rec_cmd_ns;
+static int rec_depth = 0;
+
+/* Blocks and macros are recorded as the commands they expand to, since
+ * the lines of a block never pass through the command hooks
+ */
+static bool rec_expands(char *argv[])
+{
+    return !strcmp(argv[0], "repeat") || !strcmp(argv[0], "define");
+}
+
+static void rec_pre_cmd(int argc, char *argv[])
+{
+    if (rec_expands(argv))
+        return;
+    if (rec_depth++ == 0)
+        rec_cmd_ns = time_ns();
+}
+
+static bool rec_post_cmd(int argc, char *argv[], bool ok)
+{
+    if (rec_expands(argv))
+        return ok;
+    if (--rec_depth > 0 || !rec_out || !strcmp(argv[0], "record") ||
+        !strcmp(argv[0], "replay") || !strcmp(argv[0], "quit"))
+        return ok;
+
+    int64_t latency = time_ns() - rec_cmd_ns;
+    size_t len = 0;
+    for (int i = 0; i < argc; i++)
+        len += strlen(argv[i]) + 1;
+    char *line = malloc_or_fail(len, "rec_post_cmd");
+    char *dst = line;
+    for (int i = 0; i < argc; i++) {
+        dst = stpcpy(dst, argv[i]);
+        *dst++ = ' ';
+    }
+    dst[-1] = '\0';
+
+    if (!rec_write(rec_out, rec_cmd_ns - rec_start_ns, latency, line))
+        report(1, "Warning: Could not write recorded command '%s'", line);
+    free_block(line, len);
+    return ok;
+}
+
+static bool do_record(int argc, char *argv[])
+{
+    if (argc > 2) {
+        report(1, "%s takes at most one file name", argv[0]);
+        return false;
+    }
+
+    if (rec_out) {
+        rec_close(rec_out);
+        rec_out = NULL;
+    }
+    if (argc == 1)
+        return true;
+
+    rec_out = rec_create(argv[1]);
+    if (!rec_out) {
+        report(1, "Could not create recording '%s'", argv[1]);
+        return false;
+    }
+    rec_start_ns = time_ns();
+    return true;
+}
+
+/* Latencies of each command name, recorded and replayed */
+typedef struct __replay_total {
+    char *name;
+    int calls;
+    int64_t recorded_ns;
+    int64_t replayed_ns;
+    struct __replay_total *next;
+} replay_total_t;
+
+static bool do_replay(int argc, char *argv[])
+{
+    double speed = 0;
+    if (argc < 2 || argc > 3) {
+        report(1, "%s needs file name and optional speed factor", argv[0]);
+        return false;
+    }
+    if (argc == 3) {
+        char *end;
+        speed = strtod(argv[2], &end);
+        if (*end || speed < 0) {
+            report(1, "Invalid speed factor '%s'", argv[2]);
+            return false;
+        }
+    }
+
+    rec_file_t *rf = rec_open(argv[1]);
+    if (!rf) {
+        report(1, "Could not open recording '%s'", argv[1]);
+        return false;
+    }
+
+    replay_total_t *totals = NULL;
+    char line[CMD_MAXLINE + 2];
+    int64_t rec_ns, latency_ns, start_ns = time_ns();
+    int cnt = 0;
+    while (!quit_flag &&
+           rec_read(rf, &rec_ns, &latency_ns, line, sizeof(line))) {
+        /* Hold back command until its recorded time, scaled by speed */
+        if (speed > 0) {
+            int64_t wait = start_ns + (int64_t) (rec_ns / speed) - time_ns();
+            if (wait > 0) {
+                struct timespec ts = {wait / 1000000000, wait % 1000000000};
+                nanosleep(&ts, NULL);
+            }
+        }
+
+        char name[64] = "";
+        sscanf(line, "%63s", name);
+        int64_t t = time_ns();
+        interpret_cmd(line);
+        t = time_ns() - t;
+
+        /* Keep commands in order of first appearance */
+        replay_total_t **rtp = &totals;
+        while (*rtp && strcmp((*rtp)->name, name))
+            rtp = &(*rtp)->next;
+        if (!*rtp) {
+            *rtp = calloc_or_fail(1, sizeof(replay_total_t), "do_replay");
+            (*rtp)->name = strsave_or_fail(name, "do_replay");
+        }
+        replay_total_t *rt = *rtp;
+        rt->calls++;
+        rt->recorded_ns += latency_ns;
+        rt->replayed_ns += t;
+        cnt++;
+    }
+    rec_close(rf);
+
+    report(1, "Replayed %d commands", cnt);
+    while (totals) {
+        replay_total_t *rt = totals;
+        report(1,
+               "  %-12s%6d calls | recorded %10.3f ms | replayed %10.3f ms "
+               "| %+6.1f%%",
+               rt->name, rt->calls, rt->recorded_ns * 1e-6,
+               rt->replayed_ns * 1e-6,
+               rt->recorded_ns
+                   ? 100.0 * (rt->replayed_ns - rt->recorded_ns) /
+                         rt->recorded_ns
+                   : 0.0);
+        totals = rt->next;
+        free_string(rt->name);
+        free_block(rt, sizeof(replay_total_t));
+    }
+    return true;
+}
+
+/* Add pair of functions executed around every command */
+void add_cmd_hook(pre_cmd_func_t pre, post_cmd_func_t post)
+{
+    if (hook_cnt < MAXHOOK) {
+        pre_hooks[hook_cnt] = pre;
+        post_hooks[hook_cnt] = post;
+        hook_cnt++;
+    } else
+        report_event(MSG_FATAL, "Exceeded limit on command hooks");
+}
+
 /* Turn echoing on/off */
 void set_echo(bool on)
 {
@@ -229,6 +995,11 @@ static bool do_quit(int argc, char *argv[])
     while (c) {
         cmd_element_t *ele = c;
         c = c->next;
+        while (ele->overrides) {
+            param_override_t *ovr = ele->overrides;
+            ele->overrides = ovr->next;
+            free_block(ovr, sizeof(param_override_t));
+        }
         free_block(ele, sizeof(cmd_element_t));
     }
 
@@ -238,10 +1009,33 @@ static bool do_quit(int argc, char *argv[])
         p = p->next;
         free_block(ele, sizeof(param_element_t));
     }
+    cmd_list = NULL;
+    param_list = NULL;
+    memset(cmd_table, 0, sizeof(cmd_table));
+    memset(param_table, 0, sizeof(param_table));
+    cmd_cnt = param_cnt = 0;
 
     while (buf_stack)
         pop_file();
 
+    if (capture_depth) {
+        report(1, "Unterminated block at end of input");
+        drop_blocks();
+    }
+    while (macro_list) {
+        macro_t *m = macro_list;
+        macro_list = m->next;
+        free_stmts(m->body);
+        free_string(m->name);
+        free_block(m, sizeof(macro_t));
+    }
+
+    perf_report_totals();
+    if (rec_out) {
+        rec_close(rec_out);
+        rec_out = NULL;
+    }
+
     for (int i = 0; i < quit_helper_cnt; i++) {
         ok = ok && quit_helpers[i](argc, argv);
     }
@@ -250,19 +1044,57 @@ static bool do_quit(int argc, char *argv[])
     return ok;
 }
 
+static bool do_repeat(int argc, char *argv[])
+{
+    int n;
+    if (argc < 3) {
+        report(1, "%s needs a count and a command or '{'", argv[0]);
+        return false;
+    }
+    if (!get_repeat(argv[1], &n))
+        return false;
+
+    if (argc == 3 && !strcmp(argv[2], "{"))
+        return begin_block(n, NULL);
+
+    stmt_t *s = new_stmt(argc - 2, argv + 2);
+    bool ok = run_block(s, n);
+    /* 'quit' leaves s alone, as it is not part of any block */
+    free_stmts(s);
+    return ok;
+}
+
+static bool do_define(int argc, char *argv[])
+{
+    if (argc == 1) {
+        for (macro_t *m = macro_list; m; m = m->next)
+            report(1, "  %s", m->name);
+        return true;
+    }
+    if (argc != 3 || strcmp(argv[2], "{")) {
+        report(1, "%s takes a name followed by '{'", argv[0]);
+        return false;
+    }
+    if (find_cmd(argv[1], strlen(argv[1]))) {
+        report(1, "Cannot redefine command '%s'", argv[1]);
+        return false;
+    }
+    return begin_block(1, strsave_or_fail(argv[1], "do_define"));
+}
+
 static bool do_help(int argc, char *argv[])
 {
     cmd_element_t *clist = cmd_list;
     report(1, "Commands:", argv[0]);
     while (clist) {
-        report(1, "  %-12s%-12s | %s", clist->name, clist->param,
+        report(1, "  %-14s%-12s | %s", clist->name, clist->param,
                clist->summary);
         clist = clist->next;
     }
     param_element_t *plist = param_list;
     report(1, "Options:");
     while (plist) {
-        report(1, "  %-12s%-12d | %s", plist->name, *plist->valp,
+        report(1, "  %-14s%-12d | %s", plist->name, *plist->valp,
                plist->summary);
         plist = plist->next;
     }
@@ -301,17 +1133,26 @@ static bool do_option(int argc, char *argv[])
         param_element_t *plist = param_list;
         report(1, "Options:");
         while (plist) {
-            report(1, "  %-12s%-12d | %s", plist->name, *plist->valp,
+            report(1, "  %-14s%-12d | %s", plist->name, *plist->valp,
                    plist->summary);
             plist = plist->next;
         }
+        for (cmd_element_t *clist = cmd_list; clist; clist = clist->next) {
+            for (param_override_t *ovr = clist->overrides; ovr;
+                 ovr = ovr->next) {
+                char name[64];
+                snprintf(name, sizeof(name), "%s.%s", clist->name,
+                         ovr->param->name);
+                report(1, "  %-14s%-12d | Override while running '%s'", name,
+                       ovr->value, clist->name);
+            }
+        }
         return true;
     }
 
     for (int i = 1; i < argc; i++) {
         char *name = argv[i];
         int value = 0;
-        bool found = false;
         /* Get value from next argument */
         if (i + 1 >= argc) {
             report(1, "No value given for parameter %s", name);
@@ -320,23 +1161,24 @@ static bool do_option(int argc, char *argv[])
             report(1, "Cannot parse '%s' as integer", argv[i]);
             return false;
         }
-        /* Find parameter in list */
-        param_element_t *plist = param_list;
-        while (!found && plist) {
-            if (strcmp(plist->name, name) == 0) {
-                int oldval = *plist->valp;
-                *plist->valp = value;
-                if (plist->setter)
-                    plist->setter(oldval);
-                found = true;
-            } else
-                plist = plist->next;
+        /* Per-command setting given as cmd.name */
+        char *dot = strchr(name, '.');
+        if (dot) {
+            cmd_element_t *cmd = find_cmd(name, dot - name);
+            if (!cmd || !set_cmd_param(cmd->name, dot + 1, value)) {
+                report(1, "Unknown command or parameter in '%s'", name);
+                return false;
+            }
+            continue;
         }
+        /* Find parameter in list */
+        param_element_t *plist = find_param(name);
         /* Didn't find parameter */
-        if (!found) {
+        if (!plist) {
             report(1, "Unknown parameter '%s'", name);
             return false;
         }
+        set_param_value(plist, value);
     }
 
     return true;
@@ -379,18 +1221,153 @@ static bool do_time(int argc, char *argv[])
         double elapsed = last_time - first_time;
         report(1, "Elapsed time = %.3f, Delta time = %.3f", elapsed, delta);
     } else {
-        ok = interpret_cmda(argc - 1, argv + 1);
+        /* Optional repetition count, as no command is named by a number */
+        int reps = 1, skip = 1;
+        if (argc > 2 && get_int(argv[1], &reps)) {
+            if (reps < 1) {
+                report(1, "Invalid repetition count '%s'", argv[1]);
+                return false;
+            }
+            skip = 2;
+        }
+
+        /* Each run gets a fresh copy of the arguments, as with 'repeat' */
+        stmt_t *s = reps > 1 ? new_stmt(argc - skip, argv + skip) : NULL;
+
+        /* Calibrate before starting the clocks */
+        double cycles_per_ns = time_cycles_per_ns();
+        delta_time(&last_time);
+        int64_t ns = time_ns();
+        int64_t cycles = time_cycles();
+        if (s)
+            ok = run_block(s, reps);
+        else
+            ok = interpret_cmda(argc - skip, argv + skip);
+        cycles = time_cycles() - cycles;
+        ns = time_ns() - ns;
+        free_stmts(s);
+
+        /* Calibrated counter resolves intervals finer than the clock */
+        if (cycles_per_ns > 0)
+            ns = cycles / cycles_per_ns;
+
         if (block_flag) {
             block_timing = true;
         } else {
             delta = delta_time(&last_time);
-            report(1, "Delta time = %.3f", delta);
+            if (reps == 1)
+                report(1, "Delta time = %.3f (%" PRId64 " ns, %" PRId64
+                       " cycles)", delta, ns, cycles);
+            else
+                report(1, "Delta time = %.3f (%d reps, %.1f ns, %.1f cycles "
+                       "each)", delta, reps, (double) ns / reps,
+                       (double) cycles / reps);
         }
     }
 
     return ok;
 }
 
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Smallest sample that at least pct percent of sorted samples do not
+ * exceed (nearest rank)
+ */
+static int64_t percentile(const int64_t *sorted, int cnt, int pct)
+{
+    int idx = (int) (((int64_t) cnt * pct + 99) / 100) - 1;
+    return sorted[idx > 0 ? idx : 0];
+}
+
+/* Copy src into dst, which has room for twice its length, as the text of a
+ * JSON string: quotes and backslashes are escaped, control characters
+ * become spaces
+ */
+static void json_escape(char *dst, const char *src)
+{
+    for (; *src; src++) {
+        if (*src == '"' || *src == '\\')
+            *dst++ = '\\';
+        *dst++ = (unsigned char) *src < ' ' ? ' ' : *src;
+    }
+    *dst = '\0';
+}
+
+/* Run command repeatedly, after a warm-up, and report latency statistics */
+static bool do_bench(int argc, char *argv[])
+{
+    int reps = 0;
+    if (argc < 3 || !get_int(argv[argc - 1], &reps) || reps <= 0) {
+        report(1, "Usage: %s cmd [arg ...] reps", argv[0]);
+        return false;
+    }
+
+    int cmd_argc = argc - 2;
+    char **cmd_argv = argv + 1;
+    char cmd_text[256] = "";
+    for (int i = 0, len = 0; i < cmd_argc && len < sizeof(cmd_text); i++)
+        len += snprintf(cmd_text + len, sizeof(cmd_text) - len, "%s%s",
+                        i ? " " : "", cmd_argv[i]);
+
+    /* Each run gets a fresh copy of the arguments, as with 'repeat' */
+    stmt_t *s = new_stmt(cmd_argc, cmd_argv);
+
+    /* Warm up caches, allocator and branch predictors */
+    int warmup = reps / 10 ? reps / 10 : 1;
+    bool ok = true;
+    for (int i = 0; ok && i < warmup && !quit_flag; i++)
+        ok = run_stmt(s);
+
+    int64_t *samples = calloc_or_fail(reps, sizeof(int64_t), "do_bench");
+    int cnt = 0;
+    int64_t total = 0;
+    while (ok && cnt < reps && !quit_flag) {
+        int64_t start = time_ns();
+        ok = run_stmt(s);
+        samples[cnt] = time_ns() - start;
+        total += samples[cnt++];
+    }
+    /* 'quit' leaves s alone, as it is not part of any block */
+    free_stmts(s);
+    if (!cnt) {
+        free_array(samples, reps, sizeof(int64_t));
+        return ok;
+    }
+
+    qsort(samples, cnt, sizeof(int64_t), cmp_int64);
+    double mean = (double) total / cnt;
+    double ops = total ? cnt * 1e9 / total : 0;
+    if (bench_json) {
+        char json_text[2 * sizeof(cmd_text)];
+        json_escape(json_text, cmd_text);
+        report(1,
+               "{\"cmd\": \"%s\", \"reps\": %d, \"mean_ns\": %.1f, "
+               "\"p50_ns\": %ld, \"p90_ns\": %ld, \"p99_ns\": %ld, "
+               "\"max_ns\": %ld, \"ops_per_sec\": %.1f}",
+               json_text, cnt, mean, (long) percentile(samples, cnt, 50),
+               (long) percentile(samples, cnt, 90),
+               (long) percentile(samples, cnt, 99), (long) samples[cnt - 1],
+               ops);
+    } else {
+        report(1, "Benchmark of '%s': %d reps after %d warm-up", cmd_text, cnt,
+               warmup);
+        report(1,
+               "  mean %.1f ns, p50 %ld ns, p90 %ld ns, p99 %ld ns, max %ld "
+               "ns, %.1f ops/sec",
+               mean, (long) percentile(samples, cnt, 50),
+               (long) percentile(samples, cnt, 90),
+               (long) percentile(samples, cnt, 99), (long) samples[cnt - 1],
+               ops);
+    }
+
+    free_array(samples, reps, sizeof(int64_t));
+    return ok;
+}
+
 static bool use_linenoise = true;
 static int web_fd;
 
@@ -404,6 +1381,7 @@ static bool do_web(int argc, char *argv[])
 
     web_fd = web_open(port);
     if (web_fd > 0) {
+        report_flush();
         printf("listen on port %d, fd is %d\n", port, web_fd);
         line_set_eventmux_callback(web_eventmux);
         use_linenoise = false;
@@ -429,14 +1407,37 @@ void init_cmd()
     ADD_COMMAND(quit, "Exit program", "");
     ADD_COMMAND(source, "Read commands from source file", "");
     ADD_COMMAND(log, "Copy output to file", "file");
-    ADD_COMMAND(time, "Time command execution", "cmd arg ...");
+    ADD_COMMAND(time, "Time command execution, optionally repeated reps times",
+                "[reps] cmd arg ...");
+    ADD_COMMAND(bench, "Report latency of command repeated reps times",
+                "cmd arg ... reps");
     ADD_COMMAND(web, "Read commands from builtin web server", "[port]");
+    ADD_COMMAND(repeat,
+                "Repeat command, or lines up to matching '}', count times",
+                "count {|cmd arg ...");
+    ADD_COMMAND(define,
+                "Define macro from lines up to matching '}', list without "
+                "name",
+                "[name {]");
+    ADD_COMMAND(record,
+                "Record commands and their latency to file, stop without file",
+                "[file]");
+    ADD_COMMAND(replay,
+                "Replay recorded commands, fastest or at speed factor, and "
+                "compare latencies",
+                "file [speed]");
     add_cmd("#", do_comment_cmd, "Display comment", "...");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
     add_param("verbose", &verblevel, "Verbosity level", NULL);
     add_param("error", &err_limit, "Number of errors until exit", NULL);
     add_param("echo", &echo, "Do/don't echo commands", NULL);
     add_param("entropy", &show_entropy, "Show/Hide Shannon entropy", NULL);
+    add_param("benchjson", &bench_json, "Print bench results as JSON", NULL);
+    add_param("perf", &perf_mode, "Report hardware counters of every command",
+              perf_setter);
+
+    add_cmd_hook(perf_pre_cmd, perf_post_cmd);
+    add_cmd_hook(rec_pre_cmd, rec_post_cmd);
 
     init_in();
     init_time(&last_time);
@@ -459,7 +1460,26 @@ static bool push_file(char *fname)
 
     rio_t *rnew = malloc_or_fail(sizeof(rio_t), "push_file");
     rnew->fd = fd;
+    rnew->tty = isatty(fd);
+    rnew->mapped = false;
+    rnew->eof = false;
     rnew->count = 0;
+
+    /* Map regular files, unless they are partly consumed already */
+    struct stat st;
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        lseek(fd, 0, SEEK_CUR) == 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            rnew->mapped = true;
+            rnew->eof = true;
+            rnew->buf = map;
+            rnew->count = st.st_size;
+        }
+    }
+    if (!rnew->mapped)
+        rnew->buf = malloc_or_fail(RIO_BUFSIZE, "push_file");
     rnew->bufptr = rnew->buf;
     rnew->prev = buf_stack;
     buf_stack = rnew;
@@ -473,6 +1493,10 @@ static void pop_file()
     if (buf_stack) {
         rio_t *rsave = buf_stack;
         buf_stack = rsave->prev;
+        if (rsave->mapped)
+            munmap(rsave->buf, rsave->bufptr - rsave->buf + rsave->count);
+        else
+            free_block(rsave->buf, RIO_BUFSIZE);
         close(rsave->fd);
         free_block(rsave, sizeof(rio_t));
     }
@@ -484,60 +1508,60 @@ static void init_in()
     buf_stack = NULL;
 }
 
-/* Read command from input file.
- * When hit EOF, close that file and return NULL
+/* Read command from input file, storing its length in *lenp.  The line
+ * stays in the input buffer until the next call.  Longer lines than
+ * CMD_MAXLINE are split.  When hit EOF, close that file and return NULL
  */
-static char *readline()
+static char *readline(size_t *lenp)
 {
-    char c;
-    char *lptr = linebuf;
-
-    if (!buf_stack)
+    rio_t *rio = buf_stack;
+    if (!rio)
         return NULL;
 
-    for (int cnt = 0; cnt < RIO_BUFSIZE - 2; cnt++) {
-        if (buf_stack->count <= 0) {
-            /* Need to read from input file */
-            buf_stack->count = read(buf_stack->fd, buf_stack->buf, RIO_BUFSIZE);
-            buf_stack->bufptr = buf_stack->buf;
-            if (buf_stack->count <= 0) {
-                /* Encountered EOF */
-                pop_file();
-                if (cnt > 0) {
-                    /* Last line of file did not terminate with newline. */
-                    /*  Terminate line & return it */
-                    *lptr++ = '\n';
-                    *lptr++ = '\0';
-                    if (echo) {
-                        report_noreturn(1, prompt);
-                        report_noreturn(1, linebuf);
-                    }
-                    return linebuf;
-                }
-                return NULL;
-            }
-        }
-
-        /* Have text in buffer */
-        c = *buf_stack->bufptr++;
-        *lptr++ = c;
-        buf_stack->count--;
-        if (c == '\n')
+    size_t avail = rio->count < CMD_MAXLINE ? rio->count : CMD_MAXLINE;
+    char *nl = memchr(rio->bufptr, '\n', avail);
+    while (!nl && rio->count < CMD_MAXLINE && !rio->eof) {
+        /* Move partial line to start of buffer and read more */
+        memmove(rio->buf, rio->bufptr, rio->count);
+        rio->bufptr = rio->buf;
+        /* Show output of previous commands before waiting for input */
+        report_flush();
+        ssize_t n =
+            read(rio->fd, rio->buf + rio->count, RIO_BUFSIZE - rio->count);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            rio->eof = true;
             break;
+        }
+        size_t searched = avail;
+        rio->count += n;
+        avail = rio->count < CMD_MAXLINE ? rio->count : CMD_MAXLINE;
+        nl = memchr(rio->bufptr + searched, '\n', avail - searched);
     }
 
-    if (c != '\n') {
-        /* Hit buffer limit.  Artificially terminate line */
-        *lptr++ = '\n';
+    /* Without newline, line is either split or last of file */
+    size_t len = nl ? nl - rio->bufptr + 1 : avail;
+    if (!len) {
+        /* Encountered EOF */
+        pop_file();
+        return NULL;
     }
-    *lptr++ = '\0';
-
-    if (echo) {
+    char *line = rio->bufptr;
+    rio->bufptr += len;
+    rio->count -= len;
+    *lenp = len;
+
+    /* Piped standard input is not echoed, like it was with linenoise */
+    if (echo && rio->fd != STDIN_FILENO) {
+        memcpy(linebuf, line, len);
+        if (!nl)
+            linebuf[len++] = '\n';
+        linebuf[len] = '\0';
         report_noreturn(1, prompt);
         report_noreturn(1, linebuf);
     }
-
-    return linebuf;
+    return line;
 }
 
 static bool cmd_done()
@@ -554,7 +1578,6 @@ static bool cmd_done()
  * nfds should be set to the maximum file descriptor for network sockets.
  * If nfds == 0, this indicates that there is no pending network activity
  */
-int web_connfd;
 static int cmd_select(int nfds,
                       fd_set *readfds,
                       fd_set *writefds,
@@ -577,20 +1600,33 @@ static int cmd_select(int nfds,
         FD_ZERO(readfds);
         FD_SET(infd, readfds);
 
-        /* If web not ready listen */
-        if (web_fd != -1)
-            FD_SET(web_fd, readfds);
-
-        if (infd == STDIN_FILENO && prompt_flag) {
+        if (buf_stack->tty && prompt_flag) {
+            report_flush();
+            /* Web requests arrive through linenoise too, see do_web */
             char *cmdline = linenoise(prompt);
             if (cmdline)
                 interpret_cmd(cmdline);
+            web_finish();
             fflush(stdout);
             prompt_flag = true;
-        } else if (infd != STDIN_FILENO) {
-            char *cmdline = readline();
+        } else if (!buf_stack->tty) {
+            /* Serve web clients while waiting for more input */
+            if (web_active() && buf_stack->fd == STDIN_FILENO &&
+                !memchr(buf_stack->bufptr, '\n', buf_stack->count)) {
+                char cmdline[CMD_MAXLINE + 2];
+                report_flush();
+                while (!quit_flag && web_eventmux(cmdline) > 0) {
+                    interpret_cmd(cmdline);
+                    web_finish();
+                    report_flush();
+                }
+                if (quit_flag)
+                    return 0;
+            }
+            size_t len;
+            char *cmdline = readline(&len);
             if (cmdline)
-                interpret_cmd(cmdline);
+                interpret_line(cmdline, len);
         }
     }
     return 0;
@@ -646,15 +1682,70 @@ void completion(const char *buf, line_completions_t *lc)
     }
 }
 
+/* Execute compiled trace, with the same effect and output as its text.
+ * Commands are looked up and lines tokenized once, not per execution.
+ */
+static bool run_compiled(char *fname)
+{
+    bc_program_t *prog = bc_load(fname);
+    if (!prog) {
+        report(1, "ERROR: Could not load compiled trace '%s'", fname);
+        return false;
+    }
+    has_infile = true;
+
+    for (int i = 0; i < prog->line_cnt; i++) {
+        bc_line_t *l = &prog->lines[i];
+        l->cmd = l->argc ? find_cmd(l->tokens, strlen(l->tokens)) : NULL;
+    }
+
+    /* Commands may modify their arguments, so each run gets a fresh copy */
+    char *scratch = malloc_or_fail(prog->max_tok_len + 1, "run_compiled");
+    char **argv =
+        calloc_or_fail(prog->max_argc + 1, sizeof(char *), "run_compiled");
+    for (int i = 0; i < prog->insn_cnt; i++) {
+        bc_line_t *l = &prog->lines[prog->insns[i].line];
+        for (int r = 0; r < prog->insns[i].repeat && !quit_flag; r++) {
+            if (echo) {
+                report_noreturn(1, prompt);
+                report_noreturn(1, l->text);
+            }
+            memcpy(scratch, l->tokens, l->tok_len);
+            for (int a = 0; a < l->argc; a++)
+                argv[a] = scratch + l->offsets[a];
+            if (capture_depth)
+                capture_line(l->argc, argv);
+            else if (l->cmd)
+                execute_cmd(l->cmd, l->argc, argv);
+            else
+                interpret_cmda(l->argc, argv);
+            report_flush();
+
+            /* Files read by 'source' run before the next line */
+            while (!cmd_done())
+                cmd_select(0, NULL, NULL, NULL, NULL);
+        }
+    }
+
+    free_block(scratch, prog->max_tok_len + 1);
+    free_array(argv, prog->max_argc + 1, sizeof(char *));
+    bc_free(prog);
+    return err_cnt == 0;
+}
+
 bool run_console(char *infile_name)
 {
+    if (infile_name && bc_is_compiled(infile_name))
+        return run_compiled(infile_name);
+
     if (!push_file(infile_name)) {
         report(1, "ERROR: Could not open source file '%s'", infile_name);
         return false;
     }
 
-    if (!has_infile) {
+    if (!has_infile && buf_stack->tty) {
         char *cmdline;
+        report_flush();
         while (use_linenoise && (cmdline = linenoise(prompt))) {
             interpret_cmd(cmdline);
             line_history_add(cmdline);       /* Add to the history. */
@@ -663,6 +1754,7 @@ bool run_console(char *infile_name)
             while (buf_stack && buf_stack->fd != STDIN_FILENO)
                 cmd_select(0, NULL, NULL, NULL, NULL);
             has_infile = false;
+            report_flush();
         }
         if (!use_linenoise) {
             while (!cmd_done())
@@ -8,6 +8,9 @@
 
 #define HISTORY_FILE ".cmd_history"
 
+/* Longer input lines are split, counting the newline */
+#define CMD_MAXLINE 8190
+
 /* Implementation of simple command-line interface */
 
 /* Simulation flag of console option */
@@ -24,6 +27,9 @@ typedef struct __cmd_element {
     cmd_func_t operation;
     char *summary;
     char *param;
+    /* Parameter values in effect only while this command executes */
+    struct __param_override *overrides;
+    int id; /* Order in which commands were added */
     struct __cmd_element *next;
 } cmd_element_t;
 
@@ -50,12 +56,33 @@ void add_cmd(char *name, cmd_func_t operation, char *summary, char *parameter);
 /* Add a new parameter */
 void add_param(char *name, int *valp, char *summary, setter_func_t setter);
 
+/* Override value of parameter whenever the named command executes.
+ * Also available from scripts as 'option cmd.name val'.
+ */
+bool set_cmd_param(char *cmd_name, char *param_name, int value);
+
+/* Identifier of innermost command being executed, -1 when there is none */
+int current_cmd_id();
+
+/* Name of command with identifier, NULL when there is none */
+const char *cmd_name(int id);
+
 /* Extract integer from text and store at loc */
 bool get_int(char *vname, int *loc);
 
 /* Add function to be executed as part of program exit */
 void add_quit_helper(cmd_func_t qf);
 
+/* Functions invoked right before and after each command executes.
+ * The post function sees whether the command succeeded and may turn
+ * success into failure by returning false.
+ */
+typedef void (*pre_cmd_func_t)(int argc, char *argv[]);
+typedef bool (*post_cmd_func_t)(int argc, char *argv[], bool ok);
+
+/* Add pair of functions executed around every command.  Either may be NULL */
+void add_cmd_hook(pre_cmd_func_t pre, post_cmd_func_t post);
+
 /* Turn echoing on/off */
 void set_echo(bool on);
 
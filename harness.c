@@ -6,8 +6,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "dudect/cpucycles.h"
 #include "report.h"
 
 /* Our program needs to use regular malloc/free */
@@ -25,6 +28,9 @@
 /* Value at end of every block */
 #define MAGICFOOTER 0xbeefdead
 
+/* Value at start of every block allocated in lightweight mode */
+#define MAGICLIGHT 0xfeedface
+
 /* Byte to fill newly malloced space with */
 #define FILLCHAR 0x55
 
@@ -36,13 +42,56 @@
 typedef struct __block_element {
     struct __block_element *next, *prev;
     size_t payload_size;
+    const char *file; /* Where the block was allocated */
+    int line;
     size_t magic_header; /* Marker to see if block seems legitimate */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_element_t;
 
+/* Lightweight mode keeps only the size, for the byte counter.  The magic
+ * number sits right before the payload in both layouts, so test_free can
+ * tell which kind of block it was handed.
+ */
+typedef struct {
+    size_t payload_size;
+    size_t magic_header;
+    unsigned char payload[0];
+} light_block_t;
+
 static block_element_t *allocated = NULL;
 static size_t allocated_count = 0;
+static size_t allocated_bytes = 0;
+
+/* Commands run on the one thread of qtest, and time limits never interrupt
+ * an allocator call halfway, so plain updates keep the counters exact.
+ */
+#define STAT_ADD(var, n) ((var) += (n))
+#define STAT_SUB(var, n) ((var) -= (n))
+#define STAT_GET(var) (var)
+
+/* Running totals reported by harness_stats() */
+static size_t total_allocs = 0;
+static size_t total_frees = 0;
+static uint64_t total_cycles = 0;
+static uint64_t libc_cycles = 0;
+
+/* Cost of reading the cycle counter, deducted from profiled intervals */
+static int64_t tsc_cost = -1;
+
+int lightweight_mode = 0;
+int harness_profile = 0;
+
+/* Freed blocks are parked in a FIFO quarantine instead of being returned to
+ * libc right away.  Their payload stays filled with FILLCHAR, so a write
+ * through a dangling pointer is caught when the block is finally evicted.
+ */
+static block_element_t *quarantine_head = NULL, *quarantine_tail = NULL;
+static size_t quarantine_count = 0;
+static size_t quarantine_bytes = 0;
+
+int quarantine_limit = 1024;
+int quarantine_kb = 1024;
 
 /* Percent probability of malloc failure */
 int fail_probability = 0;
@@ -52,13 +101,44 @@ static bool noallocate_mode = false;
 static bool error_occurred = false;
 static char *error_message = "";
 
-static int time_limit = 1;
+/* Time limit of risky operations, in milliseconds (0 = unlimited) */
+int time_limit = 1000;
+int time_cpu = 0;
+int time_warn = 75;
+double time_scale = 1.0;
+
+/* Start and limit of the current time-limited operation, in milliseconds */
+static double time_start;
+static int time_budget;
 
 /* Data for managing exceptions */
-static jmp_buf env;
+sigjmp_buf exception_env;
 static volatile sig_atomic_t jmp_ready = false;
 static bool time_limited = false;
 
+/* Allocator calls must not be left by longjmp, as libc may be holding its
+ * arena lock and the block lists may be half linked.  A time limit that
+ * expires inside one takes effect once the call returns.
+ */
+static volatile sig_atomic_t in_allocator = false;
+static volatile sig_atomic_t exception_pending = false;
+
+static void allocator_enter()
+{
+    in_allocator = true;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+static void allocator_leave()
+{
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    in_allocator = false;
+    if (exception_pending) {
+        exception_pending = false;
+        siglongjmp(exception_env, 1);
+    }
+}
+
 /* For test_malloc and test_calloc */
 typedef enum {
     TEST_MALLOC,
@@ -122,28 +202,120 @@ static size_t *find_footer(block_element_t *b)
     return p;
 }
 
-static void *alloc(alloc_t alloc_type, size_t size)
+/* Start measuring a profiled interval */
+static uint64_t profile_start()
 {
-    if (noallocate_mode) {
-        char *msg_alloc_forbidden[] = {
-            "Calls to malloc are disallowed",
-            "Calls to calloc are disallowed",
-        };
-        report_event(MSG_FATAL, "%s", msg_alloc_forbidden[alloc_type]);
-        return NULL;
+    if (tsc_cost < 0) {
+        for (int i = 0; i < 100; i++) {
+            int64_t start = cpucycles();
+            int64_t delta = cpucycles() - start;
+            if (tsc_cost < 0 || delta < tsc_cost)
+                tsc_cost = delta;
+        }
     }
+    return cpucycles();
+}
 
-    if (fail_allocation()) {
-        char *msg_alloc_failure[] = {
-            "Malloc returning NULL",
-            "Calloc returning NULL",
-        };
-        report_event(MSG_WARN, "%s", msg_alloc_failure[alloc_type]);
+/* Call into libc, accounting its time separately when profiling.
+ * Each nested measurement also charges its own counter reads to libc, so
+ * that they do not show up as harness overhead.
+ */
+static void *libc_alloc(alloc_t alloc_type, size_t bytes)
+{
+    if (!harness_profile)
+        return alloc_type == TEST_CALLOC ? calloc(1, bytes) : malloc(bytes);
+
+    uint64_t start = profile_start();
+    void *p = alloc_type == TEST_CALLOC ? calloc(1, bytes) : malloc(bytes);
+    STAT_ADD(libc_cycles, cpucycles() - start + tsc_cost);
+    return p;
+}
+
+static void libc_free(void *p)
+{
+    if (!harness_profile) {
+        free(p);
+        return;
+    }
+
+    uint64_t start = profile_start();
+    free(p);
+    STAT_ADD(libc_cycles, cpucycles() - start + tsc_cost);
+}
+
+/* Check that a quarantined block is still poisoned, then release it */
+static void quarantine_release(block_element_t *b)
+{
+    unsigned char *p = b->payload;
+    size_t i = 0;
+    while (i < b->payload_size && p[i] == FILLCHAR)
+        i++;
+    if (i < b->payload_size || *find_footer(b) != MAGICFREE) {
+        report_event(MSG_ERROR,
+                     "Block with address %p (%zu bytes, allocated at %s:%d) "
+                     "was written at offset %zu after being freed",
+                     (void *) p, b->payload_size, b->file ? b->file : "?",
+                     b->line, i);
+        error_occurred = true;
+    }
+
+    quarantine_count--;
+    quarantine_bytes -= b->payload_size;
+    libc_free(b);
+}
+
+/* Evict oldest blocks until quarantine fits within its limits */
+static void quarantine_trim()
+{
+    size_t limit_bytes = (size_t) quarantine_kb << 10;
+    while (quarantine_head &&
+           (quarantine_count > (size_t) quarantine_limit ||
+            (quarantine_kb > 0 && quarantine_bytes > limit_bytes))) {
+        block_element_t *b = quarantine_head;
+        quarantine_head = b->next;
+        if (!quarantine_head)
+            quarantine_tail = NULL;
+        quarantine_release(b);
+    }
+}
+
+static void quarantine_add(block_element_t *b)
+{
+    b->next = NULL;
+    b->prev = quarantine_tail;
+    if (quarantine_tail)
+        quarantine_tail->next = b;
+    else
+        quarantine_head = b;
+    quarantine_tail = b;
+    quarantine_count++;
+    quarantine_bytes += b->payload_size;
+    quarantine_trim();
+}
+
+static void *alloc_light(alloc_t alloc_type, size_t size)
+{
+    light_block_t *b = libc_alloc(alloc_type, size + sizeof(light_block_t));
+    if (!b) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
         return NULL;
     }
 
-    block_element_t *new_block =
-        malloc(size + sizeof(block_element_t) + sizeof(size_t));
+    b->payload_size = size;
+    b->magic_header = MAGICLIGHT;
+    STAT_ADD(allocated_count, 1);
+    STAT_ADD(allocated_bytes, size);
+    STAT_ADD(total_allocs, 1);
+    return b->payload;
+}
+
+static void *alloc_checked(alloc_t alloc_type,
+                           size_t size,
+                           const char *file,
+                           int line)
+{
+    size_t bytes = size + sizeof(block_element_t) + sizeof(size_t);
+    block_element_t *new_block = libc_alloc(TEST_MALLOC, bytes);
     if (!new_block) {
         report_event(MSG_FATAL, "Couldn't allocate any more memory");
         error_occurred = true;
@@ -153,6 +325,8 @@ static void *alloc(alloc_t alloc_type, size_t size)
     new_block->magic_header = MAGICHEADER;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->payload_size = size;
+    new_block->file = file;
+    new_block->line = line;
     *find_footer(new_block) = MAGICFOOTER;
     void *p = (void *) &new_block->payload;
     memset(p, !alloc_type * FILLCHAR, size);
@@ -164,8 +338,52 @@ static void *alloc(alloc_t alloc_type, size_t size)
     if (allocated)
         allocated->prev = new_block;
     allocated = new_block;
-    allocated_count++;
+    STAT_ADD(allocated_count, 1);
+    STAT_ADD(allocated_bytes, size);
+    STAT_ADD(total_allocs, 1);
+
+    return p;
+}
+
+static void *alloc_payload(alloc_t alloc_type,
+                           size_t size,
+                           const char *file,
+                           int line)
+{
+    if (noallocate_mode) {
+        char *msg_alloc_forbidden[] = {
+            "Calls to malloc are disallowed",
+            "Calls to calloc are disallowed",
+        };
+        report_event(MSG_FATAL, "%s", msg_alloc_forbidden[alloc_type]);
+        return NULL;
+    }
+
+    if (fail_allocation()) {
+        char *msg_alloc_failure[] = {
+            "Malloc returning NULL",
+            "Calloc returning NULL",
+        };
+        report_event(MSG_WARN, "%s", msg_alloc_failure[alloc_type]);
+        return NULL;
+    }
 
+    uint64_t start = harness_profile ? profile_start() : 0;
+    void *p = lightweight_mode ? alloc_light(alloc_type, size)
+                               : alloc_checked(alloc_type, size, file, line);
+    if (harness_profile)
+        STAT_ADD(total_cycles, cpucycles() - start - tsc_cost);
+    return p;
+}
+
+static void *alloc(alloc_t alloc_type,
+                   size_t size,
+                   const char *file,
+                   int line)
+{
+    allocator_enter();
+    void *p = alloc_payload(alloc_type, size, file, line);
+    allocator_leave();
     return p;
 }
 
@@ -173,31 +391,46 @@ static void *alloc(alloc_t alloc_type, size_t size)
 
 void *test_malloc(size_t size)
 {
-    return alloc(TEST_MALLOC, size);
+    return test_malloc_at(size, NULL, 0);
+}
+
+void *test_malloc_at(size_t size, const char *file, int line)
+{
+    return alloc(TEST_MALLOC, size, file, line);
 }
 
 // cppcheck-suppress unusedFunction
 void *test_calloc(size_t nelem, size_t elsize)
+{
+    return test_calloc_at(nelem, elsize, NULL, 0);
+}
+
+void *test_calloc_at(size_t nelem, size_t elsize, const char *file, int line)
 {
     /* Reference: Malloc tutorial
      * https://danluu.com/malloc-tutorial/
      */
     if (!nelem || !elsize || nelem > SIZE_MAX / elsize)
         return NULL;
-    return alloc(TEST_CALLOC, nelem * elsize);
+    return alloc(TEST_CALLOC, nelem * elsize, file, line);
 }
 
-void test_free(void *p)
+static void free_light(light_block_t *b)
 {
-    if (noallocate_mode) {
-        report_event(MSG_FATAL, "Calls to free disallowed");
-        return;
-    }
+    STAT_SUB(allocated_count, 1);
+    STAT_SUB(allocated_bytes, b->payload_size);
+    STAT_ADD(total_frees, 1);
+    b->magic_header = MAGICFREE;
+    libc_free(b);
+}
 
-    if (!p)
+static void free_checked(void *p)
+{
+    block_element_t *b = find_header(p);
+    /* Already freed and still in quarantine: error reported above */
+    if (b->magic_header == MAGICFREE)
         return;
 
-    block_element_t *b = find_header(p);
     size_t footer = *find_footer(b);
     if (footer != MAGICFOOTER) {
         report_event(MSG_ERROR,
@@ -220,15 +453,52 @@ void test_free(void *p)
     if (bn)
         bn->prev = bp;
 
-    free(b);
-    allocated_count--;
+    STAT_SUB(allocated_count, 1);
+    STAT_SUB(allocated_bytes, b->payload_size);
+    STAT_ADD(total_frees, 1);
+    if (quarantine_limit > 0)
+        quarantine_add(b);
+    else
+        libc_free(b);
+}
+
+static void free_payload(void *p)
+{
+    if (noallocate_mode) {
+        report_event(MSG_FATAL, "Calls to free disallowed");
+        return;
+    }
+
+    if (!p)
+        return;
+
+    uint64_t start = harness_profile ? profile_start() : 0;
+    light_block_t *lb = (light_block_t *) ((size_t) p - sizeof(light_block_t));
+    if (lb->magic_header == MAGICLIGHT)
+        free_light(lb);
+    else
+        free_checked(p);
+    if (harness_profile)
+        STAT_ADD(total_cycles, cpucycles() - start - tsc_cost);
+}
+
+void test_free(void *p)
+{
+    allocator_enter();
+    free_payload(p);
+    allocator_leave();
 }
 
 // cppcheck-suppress unusedFunction
 char *test_strdup(const char *s)
+{
+    return test_strdup_at(s, NULL, 0);
+}
+
+char *test_strdup_at(const char *s, const char *file, int line)
 {
     size_t len = strlen(s) + 1;
-    void *new = test_malloc(len);
+    void *new = test_malloc_at(len, file, line);
     if (!new)
         return NULL;
 
@@ -237,7 +507,51 @@ char *test_strdup(const char *s)
 
 size_t allocation_check()
 {
-    return allocated_count;
+    return STAT_GET(allocated_count);
+}
+
+/* Report running totals of allocator activity */
+void harness_stats(harness_stats_t *st)
+{
+    st->allocs = STAT_GET(total_allocs);
+    st->frees = STAT_GET(total_frees);
+    st->bytes = STAT_GET(allocated_bytes);
+    uint64_t cycles = STAT_GET(total_cycles);
+    uint64_t libc = STAT_GET(libc_cycles);
+    st->overhead_cycles = cycles > libc ? cycles - libc : 0;
+}
+
+void *allocation_mark()
+{
+    return allocated;
+}
+
+/* Newer blocks are at the head of the list, down to mark */
+size_t allocation_release(void *mark)
+{
+    size_t cnt = 0;
+    while (allocated && allocated != mark) {
+        block_element_t *b = allocated;
+        allocated = b->next;
+        STAT_SUB(allocated_count, 1);
+        STAT_SUB(allocated_bytes, b->payload_size);
+        STAT_ADD(total_frees, 1);
+        b->magic_header = MAGICFREE;
+        libc_free(b);
+        cnt++;
+    }
+    if (allocated)
+        allocated->prev = NULL;
+    return cnt;
+}
+
+/* Release every quarantined block, checking it was not written after free */
+void quarantine_flush()
+{
+    int saved_limit = quarantine_limit;
+    quarantine_limit = 0;
+    quarantine_trim();
+    quarantine_limit = saved_limit;
 }
 
 /* Implementation of functions for testing */
@@ -266,30 +580,60 @@ bool error_check()
     return e;
 }
 
-/* Prepare for a risky operation using setjmp.
- * Function returns true for initial return, false for error return
+/* Current reading of the clock selected by time_cpu, in milliseconds */
+static double time_now()
+{
+    struct timespec ts;
+    clock_gettime(time_cpu ? CLOCK_PROCESS_CPUTIME_ID : CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+}
+
+/* Arm (ms > 0) or disarm (ms == 0) the interval timer.
+ * Wall time raises SIGALRM, CPU time raises SIGPROF.
  */
-bool exception_setup(bool limit_time)
-{
-    if (sigsetjmp(env, 1)) {
-        /* Got here from longjmp */
-        jmp_ready = false;
-        if (time_limited) {
-            alarm(0);
-            time_limited = false;
-        }
+static void set_timer(int ms)
+{
+    struct itimerval it = {
+        .it_value.tv_sec = ms / 1000,
+        .it_value.tv_usec = (ms % 1000) * 1000,
+    };
+    setitimer(time_cpu ? ITIMER_PROF : ITIMER_REAL, &it, NULL);
+}
 
-        if (error_message)
-            report_event(MSG_ERROR, error_message);
-        error_message = "";
-        return false;
-    }
+/* Disarm timer and return the time used by the limited operation */
+static double stop_timer()
+{
+    set_timer(0);
+    time_limited = false;
+    return time_now() - time_start;
+}
+
+/* Got to exception_setup() by longjmp */
+bool exception_caught()
+{
+    jmp_ready = false;
+    double elapsed = -1;
+    if (time_limited)
+        elapsed = stop_timer();
+
+    if (error_message)
+        report_event(MSG_ERROR, error_message);
+    if (elapsed >= 0)
+        report(1, "Operation stopped after %.1f ms (%s time limit %d ms)",
+               elapsed, time_cpu ? "CPU" : "wall", time_budget);
+    error_message = "";
+    return false;
+}
 
-    /* Got here from initial call */
+/* Got to exception_setup() by the initial call */
+bool exception_armed(bool limit_time)
+{
     jmp_ready = true;
-    if (limit_time) {
-        alarm(time_limit);
+    if (limit_time && time_limit > 0) {
         time_limited = true;
+        time_budget = time_limit * time_scale + 0.5;
+        time_start = time_now();
+        set_timer(time_budget);
     }
     return true;
 }
@@ -298,8 +642,10 @@ bool exception_setup(bool limit_time)
 void exception_cancel()
 {
     if (time_limited) {
-        alarm(0);
-        time_limited = false;
+        double elapsed = stop_timer();
+        if (time_warn > 0 && elapsed * 100 >= (double) time_warn * time_budget)
+            report(1, "Warning: Operation took %.1f ms of %s time limit %d ms",
+                   elapsed, time_cpu ? "CPU" : "wall", time_budget);
     }
 
     jmp_ready = false;
@@ -311,8 +657,10 @@ void trigger_exception(char *msg)
 {
     error_occurred = true;
     error_message = msg;
-    if (jmp_ready)
-        siglongjmp(env, 1);
+    if (jmp_ready && in_allocator)
+        exception_pending = true;
+    else if (jmp_ready)
+        siglongjmp(exception_env, 1);
     else
         exit(1);
 }
@@ -4,6 +4,8 @@
 #include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /* This test harness enables us to do stringent testing of code.
  * It overloads the library versions of malloc and free with ones that
@@ -16,14 +18,70 @@ void test_free(void *p);
 char *test_strdup(const char *s);
 /* FIXME: provide test_realloc as well */
 
+/* Same as above, but record the source location of the caller so that
+ * diagnostics can name where a corrupted block was allocated.
+ */
+void *test_malloc_at(size_t size, const char *file, int line);
+void *test_calloc_at(size_t nmemb, size_t size, const char *file, int line);
+char *test_strdup_at(const char *s, const char *file, int line);
+
 #ifdef INTERNAL
 
 /* Report number of allocated blocks */
 size_t allocation_check();
 
+/* Mark the blocks allocated so far.  allocation_release() then frees all
+ * blocks allocated after the mark, without following any pointers in them,
+ * e.g. those of queues left broken by an operation stopped on its time
+ * limit.  Blocks allocated before the mark must not be freed in between.
+ * Lightweight mode keeps no list of blocks, so nothing is released there.
+ */
+void *allocation_mark();
+size_t allocation_release(void *mark);
+
+/* Running totals of allocator activity */
+typedef struct {
+    size_t allocs;            /* Calls to malloc, calloc and strdup */
+    size_t frees;             /* Calls to free */
+    size_t bytes;             /* Payload bytes currently allocated */
+    uint64_t overhead_cycles; /* Cycles spent in harness beyond libc */
+} harness_stats_t;
+
+void harness_stats(harness_stats_t *st);
+
+/* Lightweight mode skips all per-block checks (magic numbers, poisoning,
+ * block list, cautious mode and quarantine) and only keeps the counters
+ * needed to detect leaks.  Meant for timing queue code on its own.
+ */
+extern int lightweight_mode;
+
+/* Measure cycles spent in the harness, as reported by harness_stats() */
+extern int harness_profile;
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/* Maximum number of freed blocks held in quarantine (0 disables it) */
+extern int quarantine_limit;
+
+/* Maximum kilobytes held in quarantine (0 means no byte limit) */
+extern int quarantine_kb;
+
+/* Release every quarantined block, checking it was not written after free */
+void quarantine_flush();
+
+/* Time limit of risky operations in milliseconds (0 = unlimited) */
+extern int time_limit;
+
+/* Factor applied to time limit to account for speed of this machine */
+extern double time_scale;
+
+/* Measure time limit in CPU time (SIGPROF) rather than wall time (SIGALRM) */
+extern int time_cpu;
+
+/* Report elapsed time once it exceeds this percentage of the time limit */
+extern int time_warn;
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -40,9 +98,29 @@ void set_noallocate_mode(bool noallocate);
 bool error_check();
 
 /* Prepare for a risky operation using setjmp.
- * Function returns true for initial return, false for error return
+ * Evaluates to true for initial return, false for error return.
+ *
+ * sigsetjmp() must run in the frame of the risky code: a function that
+ * called it and returned would leave the jump going back to a dead frame.
+ * Within the macro, sigsetjmp() is the whole controlling expression of an
+ * if statement, one of the few contexts C allows, so callers may still use
+ * exception_setup() inside a larger expression.
  */
-bool exception_setup(bool limit_time);
+#define exception_setup(limit_time)                  \
+    __extension__({                                  \
+        bool __armed;                                \
+        if (sigsetjmp(exception_env, 1))             \
+            __armed = exception_caught();            \
+        else                                         \
+            __armed = exception_armed(limit_time);   \
+        __armed;                                     \
+    })
+
+extern sigjmp_buf exception_env;
+
+/* Halves of exception_setup(), after the initial and the error return */
+bool exception_armed(bool limit_time);
+bool exception_caught();
 
 /* Call once past risky code */
 void exception_cancel();
@@ -54,13 +132,13 @@ void trigger_exception(char *msg);
 #else /* !INTERNAL */
 
 /* Tested program use our versions of malloc and free */
-#define malloc test_malloc
-#define calloc test_calloc
+#define malloc(size) test_malloc_at(size, __FILE__, __LINE__)
+#define calloc(nmemb, size) test_calloc_at(nmemb, size, __FILE__, __LINE__)
 #define free test_free
 
 /* Use undef to avoid strdup redefined error */
 #undef strdup
-#define strdup test_strdup
+#define strdup(s) test_strdup_at(s, __FILE__, __LINE__)
 
 #endif
 
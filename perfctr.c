@@ -0,0 +1,148 @@
+/* Hardware performance counters
+ *
+ * All counters are opened as one group, so that a single read() returns a
+ * consistent snapshot of every one of them, together with the times used to
+ * scale them when multiplexed.  Only user-space events are
+ * counted, which keeps them accessible with the default perf_event_paranoid
+ * setting.
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "perfctr.h"
+
+static const char *perf_names[N_PERF] = {
+    "cycles", "instructions", "L1D misses", "LLC misses", "branch misses",
+};
+
+static int perf_fd[N_PERF] = {-1, -1, -1, -1, -1};
+
+/* Position of each counter in the group read, -1 when unavailable */
+static int perf_slot[N_PERF] = {-1, -1, -1, -1, -1};
+static int perf_cnt = 0;
+
+#if defined(__linux__)
+#define CACHE_MISS(cache)                                              \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) |                    \
+     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} perf_events[N_PERF] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    {PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_LL)},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+static int open_event(perf_counter_t ctr, int group_fd)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perf_events[ctr].type;
+    attr.config = perf_events[ctr].config;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.disabled = group_fd == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+#endif
+
+/* Start counting.  Return false if no counter could be opened */
+bool perf_open()
+{
+    if (perf_cnt)
+        return true;
+
+#if defined(__linux__)
+    int leader = -1;
+    for (perf_counter_t ctr = 0; ctr < N_PERF; ctr++) {
+        int fd = open_event(ctr, leader);
+        if (fd < 0)
+            continue;
+        if (leader == -1)
+            leader = fd;
+        perf_fd[ctr] = fd;
+        perf_slot[ctr] = perf_cnt++;
+    }
+    if (leader == -1)
+        return false;
+
+    ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return true;
+#else
+    return false;
+#endif
+}
+
+/* Stop counting and release counters */
+void perf_close()
+{
+    /* Close group members before leader */
+    for (int ctr = N_PERF - 1; ctr >= 0; ctr--) {
+        if (perf_fd[ctr] >= 0)
+            close(perf_fd[ctr]);
+        perf_fd[ctr] = -1;
+        perf_slot[ctr] = -1;
+    }
+    perf_cnt = 0;
+}
+
+bool perf_has(perf_counter_t ctr)
+{
+    return perf_slot[ctr] >= 0;
+}
+
+/* Read current value of every available counter */
+void perf_read(perf_sample_t *sample)
+{
+    uint64_t buf[N_PERF + 3] = {0};
+    int leader = -1;
+    for (int ctr = 0; ctr < N_PERF && leader == -1; ctr++)
+        leader = perf_fd[ctr];
+
+    if (leader == -1 ||
+        read(leader, buf, sizeof(buf)) < (ssize_t) (3 * sizeof(uint64_t)))
+        memset(buf, 0, sizeof(buf));
+
+    /* buf[0] holds number of counters, buf[1] and buf[2] the times enabled
+     * and running, followed by the values of the counters
+     */
+    sample->enabled_ns = buf[1];
+    sample->running_ns = buf[2];
+    for (int ctr = 0; ctr < N_PERF; ctr++)
+        sample->counts[ctr] =
+            perf_slot[ctr] >= 0 ? buf[3 + perf_slot[ctr]] : 0;
+}
+
+double perf_delta(const perf_sample_t *from,
+                  const perf_sample_t *to,
+                  uint64_t counts[N_PERF])
+{
+    uint64_t enabled = to->enabled_ns - from->enabled_ns;
+    uint64_t running = to->running_ns - from->running_ns;
+    double part = enabled ? (double) running / enabled : 1.0;
+    for (int ctr = 0; ctr < N_PERF; ctr++) {
+        uint64_t n = to->counts[ctr] - from->counts[ctr];
+        counts[ctr] = part >= 1.0 ? n : part > 0 ? n / part + 0.5 : 0;
+    }
+    return part < 1.0 ? part : 1.0;
+}
+
+const char *perf_name(perf_counter_t ctr)
+{
+    return perf_names[ctr];
+}
@@ -0,0 +1,49 @@
+#ifndef LAB0_PERFCTR_H
+#define LAB0_PERFCTR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Hardware performance counters, read through perf_event_open on Linux */
+
+typedef enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    N_PERF,
+} perf_counter_t;
+
+/* Reading of every counter, with the time the group was enabled and the
+ * time it actually ran.  It runs less than enabled when the PMU has to be
+ * shared with other events, by multiplexing.
+ */
+typedef struct {
+    uint64_t counts[N_PERF];
+    uint64_t enabled_ns, running_ns;
+} perf_sample_t;
+
+/* Start counting.  Return false if no counter could be opened */
+bool perf_open();
+
+/* Stop counting and release counters */
+void perf_close();
+
+/* Is counter available?  Some may be missing even when others work */
+bool perf_has(perf_counter_t ctr);
+
+/* Read current value of every available counter */
+void perf_read(perf_sample_t *sample);
+
+/* Counts between two samples, scaled up to the whole interval when the
+ * counters ran for only part of it.  Return the part, from 0 to 1.
+ */
+double perf_delta(const perf_sample_t *from,
+                  const perf_sample_t *to,
+                  uint64_t counts[N_PERF]);
+
+/* Short name of counter, e.g. for reports */
+const char *perf_name(perf_counter_t ctr);
+
+#endif /* LAB0_PERFCTR_H */
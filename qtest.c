@@ -19,6 +19,9 @@
 #include <time.h>
 #endif
 
+#include "bytecode.h"
+#include "complexity.h"
+#include "dudect/cpucycles.h"
 #include "dudect/fixture.h"
 #include "list.h"
 #include "random.h"
@@ -46,6 +49,9 @@ extern int show_entropy;
 
 #include "console.h"
 #include "report.h"
+#include "trace.h"
+#include "web.h"
+#include "workload.h"
 
 /* Settable parameters */
 
@@ -67,6 +73,23 @@ typedef struct {
 static queue_chain_t chain = {.size = 0};
 static queue_contex_t *current = NULL;
 
+/* Queues of a web session.  Its commands work on them, swapped in for
+ * chain and current while they run.
+ */
+#define MAXSESSION 64
+typedef struct __session {
+    char name[MAXSESSION];
+    queue_chain_t chain;
+    queue_contex_t *current;
+    struct __session *next;
+} session_t;
+
+static session_t *sessions = NULL;
+static session_t *active_session = NULL;
+static int session_depth = 0;
+
+static int session_queues();
+
 /* How many times can queue operations fail */
 static int fail_limit = BIG_LIST_SIZE;
 static int fail_count = 0;
@@ -75,9 +98,13 @@ static int string_length = MAXSTRING;
 
 static int descend = 0;
 
-#define MIN_RANDSTR_LEN 5
-#define MAX_RANDSTR_LEN 10
-static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
+/* Shape of strings inserted by 'ih RAND' and 'it RAND' */
+#define MAX_RANDSTR_LEN 1024
+static int randstr_min = 5;
+static int randstr_max = 9;
+static int randstr_dist = RAND_UNIFORM;
+static int randstr_alphabet = 26;
+static int rand_seed_val = 0;
 /* For queue_insert and queue_remove */
 typedef enum {
     POS_TAIL,
@@ -85,6 +112,7 @@ typedef enum {
 } position_t;
 /* Forward declarations */
 static bool q_show(int vlevel);
+static void set_alloc_units(int units);
 
 static bool do_free(int argc, char *argv[])
 {
@@ -128,7 +156,7 @@ static bool do_free(int argc, char *argv[])
     q_show(3);
 
     size_t bcnt = allocation_check();
-    if (!chain.size && bcnt > 0) {
+    if (!chain.size && !session_queues() && bcnt > 0) {
         report(1,
                "ERROR: There is no queue, but %lu blocks are still allocated",
                bcnt);
@@ -163,27 +191,45 @@ static bool do_new(int argc, char *argv[])
     return ok && !error_check();
 }
 
-/* TODO: Add a buf_size check of if the buf_size may be less
- * than MIN_RANDSTR_LEN.
- */
-static void fill_rand_string(char *buf, size_t buf_size)
+static void randstr_setter(int oldval)
 {
-    size_t len = 0;
-    while (len < MIN_RANDSTR_LEN)
-        len = rand() % buf_size;
-
-    uint64_t randstr_buf_64[MAX_RANDSTR_LEN] = {0};
-    randombytes((uint8_t *) randstr_buf_64, len * sizeof(uint64_t));
-    for (size_t n = 0; n < len; n++)
-        buf[n] = charset[randstr_buf_64[n] % (sizeof(charset) - 1)];
+    if (randstr_min < 0)
+        randstr_min = 0;
+    if (randstr_min > MAX_RANDSTR_LEN) {
+        report(1, "Random string length %d is too long, using %d",
+               randstr_min, MAX_RANDSTR_LEN);
+        randstr_min = MAX_RANDSTR_LEN;
+    }
+    if (randstr_max < randstr_min) {
+        report(1, "Random string length %d-%d is invalid, using %d-%d",
+               randstr_min, randstr_max, randstr_min, randstr_min);
+        randstr_max = randstr_min;
+    }
+    if (randstr_max > MAX_RANDSTR_LEN) {
+        report(1, "Random string length %d is too long, using %d",
+               randstr_max, MAX_RANDSTR_LEN);
+        randstr_max = MAX_RANDSTR_LEN;
+    }
+    if (randstr_dist < RAND_UNIFORM || randstr_dist > RAND_FIXED) {
+        report(1, "Unknown random string distribution %d", randstr_dist);
+        randstr_dist = RAND_UNIFORM;
+    }
+}
 
-    buf[len] = '\0';
+/* Reseeding also makes shuffle repeatable */
+static void seed_setter(int oldval)
+{
+    rand_seed(rand_seed_val);
+    if (rand_seed_val)
+        srand(rand_seed_val);
 }
 
 /* insertion */
 static bool queue_insert(position_t pos, int argc, char *argv[])
 {
     if (simulation) {
+        /* dudect builds its own queues */
+        set_alloc_units(-1);
         if (argc != 1) {
             report(1, "%s does not need arguments in simulation mode", argv[0]);
             return false;
@@ -200,7 +246,7 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
     }
 
     char *lasts = NULL;
-    char randstr_buf[MAX_RANDSTR_LEN];
+    char randstr_buf[MAX_RANDSTR_LEN + 1];
     int reps = 1;
     bool ok = true, need_rand = false;
     if (argc != 2 && argc != 3) {
@@ -215,6 +261,7 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
             return false;
         }
     }
+    set_alloc_units(reps);
 
     if (!strcmp(inserts, "RAND")) {
         need_rand = true;
@@ -229,7 +276,8 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
     if (current && exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
-                fill_rand_string(randstr_buf, sizeof(randstr_buf));
+                rand_string(randstr_buf, randstr_min, randstr_max,
+                            randstr_dist, randstr_alphabet);
             bool rval = pos == POS_TAIL ? q_insert_tail(current->q, inserts)
                                         : q_insert_head(current->q, inserts);
             if (rval) {
@@ -296,6 +344,7 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
      */
 #if !(defined(__aarch64__) && defined(__APPLE__))
     if (simulation) {
+        set_alloc_units(-1);
         if (argc != 1) {
             report(1, "%s does not need arguments in simulation mode", argv[0]);
             return false;
@@ -1081,6 +1130,535 @@ static bool do_shuffle(int argc, char *argv[])
     return !error_check();
 }
 
+/* Write to a block after freeing it, which the quarantine must report */
+static bool do_uaf(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    /* Without quarantine the block goes back to libc right away */
+    if (quarantine_limit <= 0 || lightweight_mode) {
+        report(1, "Quarantine is off, so no freed block can be written");
+        return false;
+    }
+    error_check();
+
+    char *p = test_malloc_at(16, __FILE__, __LINE__);
+    if (!p)
+        return false;
+    test_free(p);
+    p[0] = 'x';
+    quarantine_flush();
+    return !error_check();
+}
+
+/* Fill queue with synthetic keys, e.g. 'gen 1000 dist=zipf dup=0.2' */
+static bool do_gen(int argc, char *argv[])
+{
+    if (simulation) {
+        report(1, "%s is not available in simulation mode", argv[0]);
+        return false;
+    }
+
+    int count;
+    if (argc < 2 || !get_int(argv[1], &count) || count < 0) {
+        report(1, "%s needs number of elements and key=value parameters",
+               argv[0]);
+        return false;
+    }
+
+    workload_spec_t spec;
+    workload_init(&spec);
+    for (int i = 2; i < argc; i++) {
+        if (!workload_set(&spec, argv[i]))
+            return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Calling gen on null queue");
+        return false;
+    }
+    set_alloc_units(count);
+    error_check();
+
+    workload_t w;
+    workload_generate(&spec, count, &w);
+    report(2, "Generated %d keys, %d distinct strings", w.count, w.pool_cnt);
+
+    bool ok = true;
+    if (exception_setup(true)) {
+        for (int i = 0; ok && i < w.count; i++) {
+            if (q_insert_tail(current->q, w.keys[i])) {
+                current->size++;
+            } else {
+                fail_count++;
+                if (fail_count < fail_limit)
+                    report(2, "Insertion of %s failed", w.keys[i]);
+                else {
+                    report(1,
+                           "ERROR: Insertion of %s failed (%d failures total)",
+                           w.keys[i], fail_count);
+                    ok = false;
+                }
+            }
+            ok = ok && !error_check();
+        }
+    }
+    exception_cancel();
+    workload_free(&w);
+
+    q_show(3);
+    return ok;
+}
+
+/* Empirical complexity of queue operations
+ *
+ * Every operation is timed on fresh queues of geometrically growing sizes,
+ * keeping the fastest of a few trials, and the sweep is fitted to cost
+ * models.  Constant time insertions and removals are batched, since a
+ * single call is too short to measure.
+ */
+#define CX_TRIALS 3
+#define CX_REPS 1000
+#define CX_MIN_SIZE 256
+#define CX_STOP_NS 200000000 /* Stop growing after a 0.2 s measurement */
+#define CX_MAX_POINTS 16
+#define CX_CONFIDENCE 0.25
+/* Cache misses make long lists slower per element, which is easily taken
+ * for an extra log n factor.  Only flag models growing this much faster.
+ */
+#define CX_SLACK 4.0
+
+static int cx_max_size = 32768;
+
+static struct list_head *cx_queue(struct list_head *chain)
+{
+    return list_first_entry(chain, queue_contex_t, chain)->q;
+}
+
+static void cx_ih(struct list_head *chain)
+{
+    struct list_head *q = cx_queue(chain);
+    for (int i = 0; i < CX_REPS; i++) {
+        q_insert_head(q, "complexity");
+        q_release_element(q_remove_head(q, NULL, 0));
+    }
+}
+
+static void cx_it(struct list_head *chain)
+{
+    struct list_head *q = cx_queue(chain);
+    for (int i = 0; i < CX_REPS; i++) {
+        q_insert_tail(q, "complexity");
+        q_release_element(q_remove_tail(q, NULL, 0));
+    }
+}
+
+static void cx_free(struct list_head *chain)
+{
+    queue_contex_t *ctx = list_first_entry(chain, queue_contex_t, chain);
+    q_free(ctx->q);
+    ctx->q = NULL;
+}
+
+static void cx_size(struct list_head *chain)
+{
+    q_size(cx_queue(chain));
+}
+
+static void cx_dm(struct list_head *chain)
+{
+    q_delete_mid(cx_queue(chain));
+}
+
+static void cx_dedup(struct list_head *chain)
+{
+    q_delete_dup(cx_queue(chain));
+}
+
+static void cx_swap(struct list_head *chain)
+{
+    q_swap(cx_queue(chain));
+}
+
+static void cx_reverse(struct list_head *chain)
+{
+    q_reverse(cx_queue(chain));
+}
+
+static void cx_reverseK(struct list_head *chain)
+{
+    q_reverseK(cx_queue(chain), 3);
+}
+
+static void cx_sort(struct list_head *chain)
+{
+    q_sort(cx_queue(chain), descend);
+}
+
+static void cx_ascend(struct list_head *chain)
+{
+    q_ascend(cx_queue(chain));
+}
+
+static void cx_descend(struct list_head *chain)
+{
+    q_descend(cx_queue(chain));
+}
+
+static void cx_merge(struct list_head *chain)
+{
+    q_merge(chain, descend);
+}
+
+static const struct {
+    char *name;
+    big_o_t declared;
+    int queues;  /* Elements are spread over this many queues */
+    bool sorted; /* Operation expects sorted queues */
+    void (*run)(struct list_head *chain);
+} cx_ops[] = {
+    {"ih", BIG_O_1, 1, false, cx_ih},
+    {"it", BIG_O_1, 1, false, cx_it},
+    {"free", BIG_O_N, 1, false, cx_free},
+    {"size", BIG_O_N, 1, false, cx_size},
+    {"dm", BIG_O_N, 1, false, cx_dm},
+    {"dedup", BIG_O_N, 1, true, cx_dedup},
+    {"swap", BIG_O_N, 1, false, cx_swap},
+    {"reverse", BIG_O_N, 1, false, cx_reverse},
+    {"reverseK", BIG_O_N, 1, false, cx_reverseK},
+    {"sort", BIG_O_N_LOG_N, 1, false, cx_sort},
+    {"ascend", BIG_O_N, 1, false, cx_ascend},
+    {"descend", BIG_O_N, 1, false, cx_descend},
+    {"merge", BIG_O_N, 2, true, cx_merge},
+};
+
+#define N_CX_OPS (sizeof(cx_ops) / sizeof(cx_ops[0]))
+
+/* Fill queues for operation on n elements.  Return false if any could not
+ * be built, as when malloc failures are being simulated.
+ */
+static bool cx_prepare(struct list_head *chain, int op, int n)
+{
+    char buf[MAX_RANDSTR_LEN + 1];
+    bool ok = true;
+    INIT_LIST_HEAD(chain);
+    for (int i = 0; ok && i < cx_ops[op].queues; i++) {
+        queue_contex_t *ctx = malloc(sizeof(queue_contex_t));
+        if (!ctx) {
+            ok = false;
+            break;
+        }
+        ctx->q = q_new();
+        ctx->size = n / cx_ops[op].queues;
+        ctx->id = i;
+        list_add_tail(&ctx->chain, chain);
+        ok = ctx->q != NULL;
+        for (int j = 0; ok && j < ctx->size; j++) {
+            rand_string(buf, randstr_min, randstr_max, randstr_dist,
+                        randstr_alphabet);
+            ok = q_insert_tail(ctx->q, buf);
+        }
+        if (ok && cx_ops[op].sorted)
+            q_sort(ctx->q, descend);
+    }
+    if (!ok)
+        report(1, "ERROR: Could not build queues of %d elements for '%s'", n,
+               cx_ops[op].name);
+    return ok;
+}
+
+/* Free queues, or only their contexts when the queues are released by
+ * other means
+ */
+static void cx_release(struct list_head *chain, bool queues)
+{
+    queue_contex_t *ctx, *safe;
+    list_for_each_entry_safe (ctx, safe, chain, chain) {
+        if (queues && ctx->q)
+            q_free(ctx->q);
+        free(ctx);
+    }
+}
+
+/* Fastest of several runs of operation on n elements, or -1 on failure */
+static double cx_measure(int op, int n)
+{
+    double best = -1;
+    for (int trial = 0; trial < CX_TRIALS; trial++) {
+        struct list_head chain;
+        void *mark = allocation_mark();
+        if (!cx_prepare(&chain, op, n)) {
+            cx_release(&chain, true);
+            return -1;
+        }
+
+        struct timespec start, end;
+        bool ok = exception_setup(true);
+        if (ok) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            cx_ops[op].run(&chain);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+        }
+        exception_cancel();
+        if (!ok) {
+            /* Queues interrupted by the time limit may be broken, so their
+             * blocks are released without going through them
+             */
+            allocation_release(mark);
+            cx_release(&chain, false);
+            report(1, "ERROR: '%s' exceeded time limit with %d elements",
+                   cx_ops[op].name, n);
+            return -1;
+        }
+        cx_release(&chain, true);
+
+        double ns = (end.tv_sec - start.tv_sec) * 1e9 +
+                    (end.tv_nsec - start.tv_nsec);
+        if (best < 0 || ns < best)
+            best = ns;
+    }
+    /* Never report zero time, which the fit cannot scale */
+    return best > 1 ? best : 1;
+}
+
+/* Sweep sizes for operation and fit result.  Return false if measured
+ * class is confidently worse than declared one.
+ */
+static bool cx_estimate(int op)
+{
+    double sizes[CX_MAX_POINTS], times[CX_MAX_POINTS];
+    int cnt = 0;
+    for (int n = CX_MIN_SIZE; n <= cx_max_size && cnt < CX_MAX_POINTS;
+         n *= 2) {
+        double ns = cx_measure(op, n);
+        if (ns < 0)
+            return false;
+        report(2, "%s: %d elements in %.0f ns", cx_ops[op].name, n, ns);
+        sizes[cnt] = n;
+        times[cnt++] = ns;
+        if (ns > CX_STOP_NS)
+            break;
+    }
+
+    if (cnt < 3) {
+        report(1, "%-10s too few sizes measured", cx_ops[op].name);
+        return true;
+    }
+
+    double confidence;
+    big_o_t measured = big_o_fit(sizes, times, cnt, &confidence);
+    big_o_t declared = cx_ops[op].declared;
+    bool worse = measured > declared;
+    double excess = big_o_growth(measured, sizes[0], sizes[cnt - 1]) /
+                    big_o_growth(declared, sizes[0], sizes[cnt - 1]);
+    bool flagged = worse && confidence >= CX_CONFIDENCE && excess > CX_SLACK;
+    report(1, "%-10s %-12s %-12s %3.0f%%%s", cx_ops[op].name,
+           big_o_name(declared), big_o_name(measured), 100 * confidence,
+           flagged ? "  <-- worse than declared"
+                   : (worse ? "  (possibly worse)" : ""));
+    return !flagged;
+}
+
+static bool do_complexity(int argc, char *argv[])
+{
+    if (simulation) {
+        report(1, "%s is not available in simulation mode", argv[0]);
+        return false;
+    }
+    set_alloc_units(-1);
+
+    for (int i = 1; i < argc; i++) {
+        size_t op = 0;
+        while (op < N_CX_OPS && strcmp(argv[i], cx_ops[op].name))
+            op++;
+        if (op == N_CX_OPS) {
+            report(1, "Unknown operation '%s'", argv[i]);
+            return false;
+        }
+    }
+    error_check();
+
+    /* Searching every freed block would make freeing quadratic */
+    set_cautious_mode(false);
+    bool ok = true;
+    report(1, "%-10s %-12s %-12s %s", "Operation", "Declared", "Measured",
+           "Confidence");
+    for (size_t op = 0; op < N_CX_OPS; op++) {
+        bool selected = argc == 1;
+        for (int i = 1; i < argc && !selected; i++)
+            selected = !strcmp(argv[i], cx_ops[op].name);
+        if (selected)
+            ok = cx_estimate(op) && ok;
+    }
+    set_cautious_mode(true);
+    return ok && !error_check();
+}
+
+/* Allocator activity at the start of each command being executed.
+ * Commands may nest, e.g. 'time sort', so keep a small stack.
+ */
+#define MAX_CMD_DEPTH 8
+static struct {
+    harness_stats_t stats;
+    uint64_t cycles;
+    int units;        /* Allocation budget is per unit of work */
+    bool per_element; /* Units are elements rather than the call */
+} cmd_start[MAX_CMD_DEPTH];
+static int cmd_depth = 0;
+
+/* Maximum allocations per unit of work of a command (-1 = unlimited).
+ * Normally set for individual commands, e.g. 'option ih.budget 2'.
+ */
+static int alloc_budget = -1;
+
+/* Declare how many elements current command works on, making its budget
+ * per element.  Negative value exempts the command from its budget.
+ */
+static void set_alloc_units(int units)
+{
+    if (cmd_depth > 0 && cmd_depth <= MAX_CMD_DEPTH) {
+        cmd_start[cmd_depth - 1].units = units;
+        cmd_start[cmd_depth - 1].per_element = true;
+    }
+}
+
+static void stats_pre_cmd(int argc, char *argv[])
+{
+    if (cmd_depth < MAX_CMD_DEPTH) {
+        harness_stats(&cmd_start[cmd_depth].stats);
+        cmd_start[cmd_depth].cycles = cpucycles();
+        cmd_start[cmd_depth].units = 1;
+        cmd_start[cmd_depth].per_element = false;
+    }
+    cmd_depth++;
+}
+
+static bool stats_post_cmd(int argc, char *argv[], bool ok)
+{
+    if (--cmd_depth >= MAX_CMD_DEPTH)
+        return ok;
+
+    uint64_t cycles = cpucycles() - cmd_start[cmd_depth].cycles;
+    harness_stats_t st;
+    harness_stats(&st);
+    const harness_stats_t *old = &cmd_start[cmd_depth].stats;
+    size_t allocs = st.allocs - old->allocs;
+
+    /* The command that opened the trace started before it */
+    if (trace_active() && strcmp(argv[0], "trace"))
+        trace_event(current_cmd_id(), current ? current->id : TRACE_NO_QUEUE,
+                    current ? current->size : 0, allocs,
+                    cmd_start[cmd_depth].cycles, cycles);
+
+    if (harness_profile) {
+        /* Time in libc may outweigh the harness within one command */
+        uint64_t overhead = st.overhead_cycles > old->overhead_cycles
+                                ? st.overhead_cycles - old->overhead_cycles
+                                : 0;
+        report(1,
+               "Harness overhead of '%s': %.1f%% of %.3f Mcycles "
+               "(%zu allocs, %zu frees)",
+               argv[0], cycles ? 100.0 * overhead / cycles : 0.0,
+               cycles * 1e-6, allocs, st.frees - old->frees);
+    }
+
+    int units = cmd_start[cmd_depth].units;
+    if (alloc_budget >= 0 && units >= 0 &&
+        allocs > (size_t) alloc_budget * units) {
+        report(1,
+               "ERROR: '%s' made %zu allocations, exceeding its budget of %d "
+               "per %s (%zu allowed)",
+               argv[0], allocs, alloc_budget,
+               cmd_start[cmd_depth].per_element ? "element" : "call",
+               (size_t) alloc_budget * units);
+        ok = false;
+    }
+    return ok;
+}
+
+/* Queues left in other sessions than the one swapped in */
+static int session_queues()
+{
+    int cnt = 0;
+    for (session_t *s = sessions; s; s = s->next)
+        cnt += s->chain.size;
+    return cnt;
+}
+
+/* Exchange queues of session with those in chain and current */
+static void session_swap(session_t *s)
+{
+    LIST_HEAD(tmp);
+    list_splice_init(&chain.head, &tmp);
+    list_splice_init(&s->chain.head, &chain.head);
+    list_splice_init(&tmp, &s->chain.head);
+
+    int size = chain.size;
+    chain.size = s->chain.size;
+    s->chain.size = size;
+    queue_contex_t *cur = current;
+    current = s->current;
+    s->current = cur;
+}
+
+/* Commands of web requests run on the queues of their session.  Commands
+ * they run in turn, such as those of a macro, stay in it.
+ */
+static void session_pre_cmd(int argc, char *argv[])
+{
+    if (session_depth++ > 0)
+        return;
+    const char *name = web_session();
+    if (!name)
+        return;
+
+    session_t *s = sessions;
+    while (s && strcmp(s->name, name))
+        s = s->next;
+    if (!s) {
+        s = malloc_or_fail(sizeof(session_t), "session_pre_cmd");
+        strncpy(s->name, name, MAXSESSION - 1);
+        s->name[MAXSESSION - 1] = '\0';
+        INIT_LIST_HEAD(&s->chain.head);
+        s->chain.size = 0;
+        s->current = NULL;
+        s->next = sessions;
+        sessions = s;
+    }
+    session_swap(s);
+    active_session = s;
+}
+
+static bool session_post_cmd(int argc, char *argv[], bool ok)
+{
+    if (--session_depth == 0 && active_session) {
+        session_swap(active_session);
+        active_session = NULL;
+    }
+    return ok;
+}
+
+static bool do_trace(int argc, char *argv[])
+{
+    if (argc > 2) {
+        report(1, "%s takes at most one file name", argv[0]);
+        return false;
+    }
+
+    trace_close();
+    if (argc == 1)
+        return true;
+
+    if (!trace_open(argv[1], cmd_name)) {
+        report(1, "Could not create trace '%s'", argv[1]);
+        return false;
+    }
+    return true;
+}
+
 static void console_init()
 {
     ADD_COMMAND(new, "Create new queue", "");
@@ -1122,14 +1700,74 @@ static void console_init()
     ADD_COMMAND(reverseK, "Reverse the nodes of the queue 'K' at a time",
                 "[K]");
     ADD_COMMAND(shuffle, "Fisher-Yates shuffle Algorithm", "");
+    ADD_COMMAND(uaf, "Write to a freed block, which quarantine must report",
+                "");
+    ADD_COMMAND(gen,
+                "Insert n synthetic keys at tail. Parameters: dist=uniform|"
+                "zipf|sorted|reversed|runs, dup=F, keys=K, s=F, prefix=L, "
+                "prefixes=P, run=R, order=asc|desc, len=A[-B][:W],..., "
+                "alphabet=N, seed=S",
+                "n [key=value ...]");
+    ADD_COMMAND(complexity,
+                "Estimate complexity of queue operations over a size sweep",
+                "[op ...]");
+    ADD_COMMAND(trace,
+                "Trace every command as binary events to file, stop without "
+                "file",
+                "[file]");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
+    add_param("quarantine", &quarantine_limit,
+              "Number of freed blocks checked for use-after-free", NULL);
+    add_param("quarantine_kb", &quarantine_kb,
+              "Kilobytes of freed blocks checked for use-after-free", NULL);
+    add_param("lightweight", &lightweight_mode,
+              "Only count allocations, skipping all per-block checks", NULL);
+    add_param("overhead", &harness_profile,
+              "Report harness overhead of every command", NULL);
+    add_param("timelimit", &time_limit,
+              "Time limit of queue operations in milliseconds", NULL);
+    add_param("cputime", &time_cpu,
+              "Apply time limit to CPU time instead of wall time", NULL);
+    add_param("timewarn", &time_warn,
+              "Report time taken beyond this percentage of the limit", NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
     add_param("descend", &descend,
               "Sort and merge queue in ascending/descending order", NULL);
+    add_param("budget", &alloc_budget,
+              "Allocations allowed per command or inserted element", NULL);
+    add_param("randmin", &randstr_min, "Minimum length of RAND strings",
+              randstr_setter);
+    add_param("randmax", &randstr_max, "Maximum length of RAND strings",
+              randstr_setter);
+    add_param("randdist", &randstr_dist,
+              "Length of RAND strings: 0 uniform, 1 short, 2 fixed",
+              randstr_setter);
+    add_param("alphabet", &randstr_alphabet,
+              "Number of characters from [a-zA-Z0-9] in RAND strings", NULL);
+    add_param("cxmax", &cx_max_size,
+              "Largest queue size in complexity estimation", NULL);
+    add_param("seed", &rand_seed_val,
+              "Seed of RAND strings and shuffle, 0 for a random one",
+              seed_setter);
+
+    /* Allocation budgets guarding against regressions in queue.c */
+    set_cmd_param("new", "budget", 1);
+    set_cmd_param("ih", "budget", 2);
+    set_cmd_param("it", "budget", 2);
+    set_cmd_param("free", "budget", 0);
+    set_cmd_param("rh", "budget", 0);
+    set_cmd_param("rt", "budget", 0);
+    set_cmd_param("size", "budget", 0);
+    set_cmd_param("reverse", "budget", 0);
+    set_cmd_param("reverseK", "budget", 0);
+    set_cmd_param("swap", "budget", 0);
+    set_cmd_param("sort", "budget", 0);
+    set_cmd_param("merge", "budget", 0);
+    set_cmd_param("shuffle", "budget", 0);
 }
 
 /* Signal handlers */
@@ -1157,28 +1795,46 @@ static void q_init()
     INIT_LIST_HEAD(&chain.head);
     signal(SIGSEGV, sigsegv_handler);
     signal(SIGALRM, sigalrm_handler);
+    signal(SIGPROF, sigalrm_handler);
 }
 
 static bool q_quit(int argc, char *argv[])
 {
+    trace_close();
     report(3, "Freeing queue");
     if (current && current->size > BIG_LIST_SIZE)
         set_cautious_mode(false);
 
     if (exception_setup(true)) {
-        struct list_head *cur = chain.head.next;
-        while (chain.size > 0) {
-            queue_contex_t *qctx = list_entry(cur, queue_contex_t, chain);
-            cur = cur->next;
-            q_free(qctx->q);
-            free(qctx);
-            chain.size--;
+        /* Queues of all sessions go too */
+        while (true) {
+            struct list_head *cur = chain.head.next;
+            while (chain.size > 0) {
+                queue_contex_t *qctx = list_entry(cur, queue_contex_t, chain);
+                cur = cur->next;
+                q_free(qctx->q);
+                free(qctx);
+                chain.size--;
+            }
+            INIT_LIST_HEAD(&chain.head);
+            session_t *s = sessions;
+            if (!s)
+                break;
+            session_swap(s);
+            sessions = s->next;
+            free_block(s, sizeof(session_t));
         }
+        current = NULL;
+        active_session = NULL;
     }
 
     exception_cancel();
     set_cautious_mode(true);
 
+    quarantine_flush();
+    if (error_check())
+        return false;
+
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
         report(1, "ERROR: Freed queue, but %lu blocks are still allocated",
@@ -1191,11 +1847,17 @@ static bool q_quit(int argc, char *argv[])
 
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf(
+        "Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE][-s SCALE]"
+        "[-c OFILE]\n",
+        cmd);
     printf("\t-h         Print this information\n");
     printf("\t-f IFILE   Read commands from IFILE\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
+    printf("\t-s SCALE   Scale time limits by SCALE instead of calibrating\n");
+    printf("\t-c OFILE   Compile commands of IFILE into OFILE and exit\n");
+    printf("\t           (--compile).  -f runs compiled files directly\n");
     exit(0);
 }
 
@@ -1393,6 +2055,112 @@ uintptr_t os_random(uintptr_t seed)
     return x;
 }
 
+/* Calibration kernel: build a list scattered in memory, walk it and merge
+ * sort it, much like the performance traces do.  Its run time relative to
+ * a reference machine scales the time limit of queue operations.  The
+ * median of several rounds, after one to warm up, is steadier than any one.
+ */
+#define CALIBRATE_NODES (1 << 14)
+#define CALIBRATE_ROUNDS 7
+
+/* Median time of the kernel on the reference machine, in microseconds */
+#define CALIBRATE_REF_US 2500.0
+
+#define CALIBRATE_MIN_SCALE 1.0
+#define CALIBRATE_MAX_SCALE 16.0
+
+typedef struct __calib_node {
+    struct __calib_node *next;
+    uint32_t key;
+} calib_node_t;
+
+static calib_node_t *calib_merge(calib_node_t *a, calib_node_t *b)
+{
+    calib_node_t *head = NULL, **tail = &head;
+    while (a && b) {
+        calib_node_t **min = a->key <= b->key ? &a : &b;
+        *tail = *min;
+        tail = &(*min)->next;
+        *min = (*min)->next;
+    }
+    *tail = a ? a : b;
+    return head;
+}
+
+static calib_node_t *calib_sort(calib_node_t *head)
+{
+    if (!head || !head->next)
+        return head;
+
+    calib_node_t *slow = head, *fast = head->next;
+    while (fast && fast->next) {
+        slow = slow->next;
+        fast = fast->next->next;
+    }
+    calib_node_t *mid = slow->next;
+    slow->next = NULL;
+    return calib_merge(calib_sort(head), calib_sort(mid));
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* Return speed factor of this machine, >1 when slower than the reference.
+ * It is rounded as printed, so that '-s' can repeat a run exactly.
+ */
+static double calibrate()
+{
+    calib_node_t *nodes =
+        malloc_or_fail(CALIBRATE_NODES * sizeof(calib_node_t), "calibrate");
+    double times[CALIBRATE_ROUNDS + 1];
+
+    for (int round = 0; round <= CALIBRATE_ROUNDS; round++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        /* Link nodes in a pseudo-random order to defeat the prefetcher */
+        uint32_t x = 2463534242U;
+        calib_node_t *head = NULL;
+        for (size_t i = 0; i < CALIBRATE_NODES; i++) {
+            size_t at = (i * 40503U) & (CALIBRATE_NODES - 1);
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            nodes[at].key = x;
+            nodes[at].next = head;
+            head = &nodes[at];
+        }
+        uint32_t sum = 0;
+        for (calib_node_t *n = head; n; n = n->next)
+            sum += n->key;
+        head = calib_sort(head);
+        for (calib_node_t *n = head; n; n = n->next)
+            sum -= n->key;
+        assert(sum == 0);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        times[round] = (end.tv_sec - start.tv_sec) * 1e6 +
+                       (end.tv_nsec - start.tv_nsec) * 1e-3;
+    }
+
+    free_block(nodes, CALIBRATE_NODES * sizeof(calib_node_t));
+    /* Round 0 warms up caches and pages, and is left out */
+    qsort(times + 1, CALIBRATE_ROUNDS, sizeof(double), cmp_double);
+    double median = times[1 + CALIBRATE_ROUNDS / 2];
+    report(2, "Calibration: kernel took %.0f us (reference %.0f us)", median,
+           CALIBRATE_REF_US);
+
+    double scale = median / CALIBRATE_REF_US;
+    if (scale < CALIBRATE_MIN_SCALE)
+        scale = CALIBRATE_MIN_SCALE;
+    if (scale > CALIBRATE_MAX_SCALE)
+        scale = CALIBRATE_MAX_SCALE;
+    return (int) (scale * 100 + 0.5) / 100.0;
+}
+
 #define BUFSIZE 256
 int main(int argc, char *argv[])
 {
@@ -1405,10 +2173,17 @@ int main(int argc, char *argv[])
     char *infile_name = NULL;
     char lbuf[BUFSIZE];
     char *logfile_name = NULL;
+    char *compile_name = NULL;
     int level = 4;
+    double scale = 0;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    static const struct option long_options[] = {
+        {"compile", required_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0},
+    };
+    while ((c = getopt_long(argc, argv, "hv:f:l:s:c:", long_options, NULL)) !=
+           -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
@@ -1433,6 +2208,18 @@ int main(int argc, char *argv[])
             buf[BUFSIZE - 1] = '\0';
             logfile_name = lbuf;
             break;
+        case 's': {
+            char *endptr;
+            scale = strtod(optarg, &endptr);
+            if (endptr == optarg || *endptr != '\0' || scale <= 0) {
+                fprintf(stderr, "Invalid time scale\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        }
+        case 'c':
+            compile_name = optarg;
+            break;
         default:
             printf("Unknown option '%c'\n", c);
             usage(argv[0]);
@@ -1440,6 +2227,9 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (compile_name)
+        return !bc_compile(infile_name, compile_name, CMD_MAXLINE);
+
     /* A better seed can be obtained by combining getpid() and its parent ID
      * with the Unix time.
      */
@@ -1464,7 +2254,18 @@ int main(int argc, char *argv[])
     if (logfile_name)
         set_logfile(logfile_name);
 
+    if (scale > 0) {
+        time_scale = scale;
+        report(2, "Time limits scaled by %.2f (pinned)", time_scale);
+    } else {
+        time_scale = calibrate();
+        report(1, "Time limits scaled by %.2f (calibrated, pin with -s %.2f)",
+               time_scale, time_scale);
+    }
+
     add_quit_helper(q_quit);
+    add_cmd_hook(session_pre_cmd, session_post_cmd);
+    add_cmd_hook(stats_pre_cmd, stats_post_cmd);
 
     bool ok = true;
     ok = ok && run_console(infile_name);
@@ -291,3 +291,105 @@ int randombytes(uint8_t *buf, size_t n)
 #error "randombytes(...) is not supported on this platform"
 #endif
 }
+
+/* Buffered string generator
+ *
+ * Strings are drawn from a pool of bytes produced by xoshiro256**, so that
+ * only seeding may need a system call, not every string.
+ */
+static const char rand_chars[] =
+    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+
+#define RAND_POOL_WORDS 512
+
+static uint64_t rand_state[4];
+static int rand_seeded = 0;
+static union {
+    uint64_t word[RAND_POOL_WORDS];
+    uint8_t byte[RAND_POOL_WORDS * sizeof(uint64_t)];
+} rand_pool;
+static size_t rand_pos = sizeof(rand_pool);
+
+static inline uint64_t rotl(const uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+/* by David Blackman and Sebastiano Vigna, see:
+ * <https://prng.di.unimi.it/xoshiro256starstar.c>
+ */
+static inline uint64_t xoshiro_next(void)
+{
+    uint64_t *s = rand_state;
+    const uint64_t result = rotl(s[1] * 5, 7) * 9;
+    const uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+void rand_seed(uint64_t seed)
+{
+    if (!seed)
+        randombytes((uint8_t *) &seed, sizeof(seed));
+
+    /* Expand seed into generator state with splitmix64 */
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        rand_state[i] = z ^ (z >> 31);
+    }
+    rand_seeded = 1;
+    rand_pos = sizeof(rand_pool);
+}
+
+static inline uint8_t rand_byte(void)
+{
+    if (rand_pos == sizeof(rand_pool)) {
+        if (!rand_seeded)
+            rand_seed(0);
+        for (int i = 0; i < RAND_POOL_WORDS; i++)
+            rand_pool.word[i] = xoshiro_next();
+        rand_pos = 0;
+    }
+    return rand_pool.byte[rand_pos++];
+}
+
+uint32_t rand_uint32(void)
+{
+    return rand_byte() | (uint32_t) rand_byte() << 8 |
+           (uint32_t) rand_byte() << 16 | (uint32_t) rand_byte() << 24;
+}
+
+size_t rand_string(char *buf,
+                   size_t min_len,
+                   size_t max_len,
+                   rand_dist_t dist,
+                   size_t alphabet)
+{
+    if (max_len < min_len)
+        max_len = min_len;
+    if (alphabet < 1 || alphabet > sizeof(rand_chars) - 1)
+        alphabet = sizeof(rand_chars) - 1;
+
+    size_t len = max_len;
+    if (dist == RAND_SHORT) {
+        for (len = min_len; len < max_len && (rand_byte() & 1);)
+            len++;
+    } else if (dist == RAND_UNIFORM) {
+        uint64_t span = max_len - min_len + 1;
+        len = min_len + (rand_uint32() * span >> 32);
+    }
+
+    /* Scale byte into alphabet by multiplication instead of modulo */
+    for (size_t n = 0; n < len; n++)
+        buf[n] = rand_chars[(rand_byte() * alphabet) >> 8];
+    buf[len] = '\0';
+    return len;
+}
@@ -6,6 +6,29 @@
 
 extern int randombytes(uint8_t *buf, size_t len);
 
+/* Length distributions of generated strings */
+typedef enum {
+    RAND_UNIFORM, /* Any length between minimum and maximum */
+    RAND_SHORT,   /* Geometric, each extra character with probability 1/2 */
+    RAND_FIXED,   /* Always the maximum length */
+} rand_dist_t;
+
+/* Seed the string generator.  Seed 0 draws one from randombytes() */
+void rand_seed(uint64_t seed);
+
+/* Uniformly distributed 32-bit number from the string generator */
+uint32_t rand_uint32(void);
+
+/* Fill buf with a random string of min_len to max_len characters, taken
+ * from the first 'alphabet' characters of [a-zA-Z0-9].  buf must hold
+ * max_len + 1 bytes.  Return length of string.
+ */
+size_t rand_string(char *buf,
+                   size_t min_len,
+                   size_t max_len,
+                   rand_dist_t dist,
+                   size_t alphabet);
+
 static inline uint8_t randombit(void)
 {
     uint8_t ret = 0;
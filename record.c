@@ -0,0 +1,111 @@
+/* Recording of command streams with timing */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "record.h"
+#include "report.h"
+
+#define REC_MAGIC "QREC"
+#define REC_VERSION 1
+
+struct __rec_file {
+    FILE *file;
+    int64_t last_ns; /* Start time of previous record */
+};
+
+static void put_varint(FILE *f, uint64_t v)
+{
+    while (v >= 0x80) {
+        fputc((v & 0x7f) | 0x80, f);
+        v >>= 7;
+    }
+    fputc(v, f);
+}
+
+static bool get_varint(FILE *f, uint64_t *v)
+{
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = fgetc(f);
+        if (c == EOF)
+            return false;
+        *v |= (uint64_t) (c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static rec_file_t *rec_new(FILE *f)
+{
+    rec_file_t *rf = malloc_or_fail(sizeof(rec_file_t), "rec_new");
+    rf->file = f;
+    rf->last_ns = 0;
+    return rf;
+}
+
+rec_file_t *rec_create(const char *fname)
+{
+    FILE *f = fopen(fname, "wb");
+    if (!f)
+        return NULL;
+    fwrite(REC_MAGIC, 1, strlen(REC_MAGIC), f);
+    fputc(REC_VERSION, f);
+    return rec_new(f);
+}
+
+bool rec_write(rec_file_t *rf,
+               int64_t time_ns,
+               int64_t latency_ns,
+               const char *line)
+{
+    size_t len = strlen(line);
+    put_varint(rf->file, time_ns - rf->last_ns);
+    put_varint(rf->file, latency_ns);
+    put_varint(rf->file, len);
+    fwrite(line, 1, len, rf->file);
+    rf->last_ns = time_ns;
+    return !ferror(rf->file);
+}
+
+rec_file_t *rec_open(const char *fname)
+{
+    FILE *f = fopen(fname, "rb");
+    if (!f)
+        return NULL;
+
+    char magic[sizeof(REC_MAGIC)];
+    if (fread(magic, 1, strlen(REC_MAGIC), f) != strlen(REC_MAGIC) ||
+        memcmp(magic, REC_MAGIC, strlen(REC_MAGIC)) ||
+        fgetc(f) != REC_VERSION) {
+        fclose(f);
+        return NULL;
+    }
+    return rec_new(f);
+}
+
+bool rec_read(rec_file_t *rf,
+              int64_t *time_ns,
+              int64_t *latency_ns,
+              char *line,
+              size_t size)
+{
+    uint64_t delta, latency, len;
+    if (!get_varint(rf->file, &delta) || !get_varint(rf->file, &latency) ||
+        !get_varint(rf->file, &len) || len >= size ||
+        fread(line, 1, len, rf->file) != len)
+        return false;
+
+    line[len] = '\0';
+    rf->last_ns += delta;
+    *time_ns = rf->last_ns;
+    *latency_ns = latency;
+    return true;
+}
+
+void rec_close(rec_file_t *rf)
+{
+    fclose(rf->file);
+    free_block(rf, sizeof(rec_file_t));
+}
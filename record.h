@@ -0,0 +1,41 @@
+#ifndef LAB0_RECORD_H
+#define LAB0_RECORD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Compact binary log of interpreted commands and their timing.
+ *
+ * A file starts with the magic "QREC" and a version byte, followed by one
+ * record per command: start time as nanoseconds since the previous
+ * record, latency in nanoseconds, and the length of the command line, all
+ * as LEB128 varints, then the command line itself.
+ */
+
+typedef struct __rec_file rec_file_t;
+
+/* Create file for recording.  Return NULL on failure */
+rec_file_t *rec_create(const char *fname);
+
+/* Append command started time_ns after the recording started */
+bool rec_write(rec_file_t *rf,
+               int64_t time_ns,
+               int64_t latency_ns,
+               const char *line);
+
+/* Open recorded file for replay.  Return NULL if missing or malformed */
+rec_file_t *rec_open(const char *fname);
+
+/* Read next record into line, holding size bytes.
+ * Return false at end of file or on malformed record.
+ */
+bool rec_read(rec_file_t *rf,
+              int64_t *time_ns,
+              int64_t *latency_ns,
+              char *line,
+              size_t size);
+
+void rec_close(rec_file_t *rf);
+
+#endif /* LAB0_RECORD_H */
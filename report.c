@@ -10,6 +10,7 @@
 #include <unistd.h>
 
 #include "report.h"
+#include "timing.h"
 #include "web.h"
 
 #define MAX(a, b) ((a) < (b) ? (b) : (a))
@@ -18,11 +19,23 @@ static FILE *errfile = NULL;
 static FILE *verbfile = NULL;
 static FILE *logfile = NULL;
 
+/* Output of report() goes through verbfile with a large buffer of its own,
+ * so it keeps its place among anything else printed through stdio.  The
+ * buffer is written after each command, when it fills, before error messages
+ * and at exit.  Each message is formatted once and the same text goes to the
+ * log file and the web client.
+ */
+#define OUT_BUFSIZE (1 << 16)
+static char out_buf[OUT_BUFSIZE];
+static char msg_buf[4096];
+
 int verblevel = 0;
 static void init_files(FILE *efile, FILE *vfile)
 {
     errfile = efile;
     verbfile = vfile;
+    setvbuf(verbfile, out_buf, _IOFBF, sizeof(out_buf));
+    atexit(report_flush);
 }
 
 static char fail_buf[1024] = "FATAL Error.  Exiting\n";
@@ -71,6 +84,8 @@ void report_event(message_t msg, char *fmt, ...)
     if (!errfile)
         init_files(stdout, stdout);
 
+    /* Keep order with buffered output, and show this right away */
+    report_flush();
     va_start(ap, fmt);
     fprintf(errfile, "%s: ", msg_name);
     vfprintf(errfile, fmt, ap);
@@ -85,77 +100,88 @@ void report_event(message_t msg, char *fmt, ...)
         fprintf(logfile, "\n");
         fflush(logfile);
         va_end(ap);
-        fclose(logfile);
     }
 
     if (fatal) {
+        if (logfile) {
+            fclose(logfile);
+            logfile = NULL;
+        }
         if (fatal_fun)
             fatal_fun();
         exit(1);
     }
 }
 
-#define BUF_SIZE 4096
-extern int web_connfd;
-void report(int level, char *fmt, ...)
+void report_flush()
+{
+    if (!verbfile)
+        return;
+    fflush(verbfile);
+    if (logfile)
+        fflush(logfile);
+}
+
+static void report_text(const char *text, size_t len)
+{
+    if (logfile)
+        fwrite(text, 1, len, logfile);
+    if (web_connfd)
+        web_send(web_connfd, (char *) text);
+}
+
+static void report_va(bool newline, const char *fmt, va_list ap)
 {
     if (!verbfile)
         init_files(stdout, stdout);
 
-    char buffer[BUF_SIZE];
-    if (level <= verblevel) {
-        va_list ap;
-        va_start(ap, fmt);
-        vfprintf(verbfile, fmt, ap);
-        fprintf(verbfile, "\n");
-        fflush(verbfile);
-        va_end(ap);
+    /* Leave room for newline and terminator */
+    size_t room = sizeof(msg_buf) - 1;
+    va_list aq;
+    va_copy(aq, ap);
+    int len = vsnprintf(msg_buf, room, fmt, aq);
+    va_end(aq);
+    if (len < 0)
+        return;
 
-        if (logfile) {
-            va_start(ap, fmt);
-            vfprintf(logfile, fmt, ap);
-            fprintf(logfile, "\n");
-            fflush(logfile);
-            va_end(ap);
-        }
-        va_start(ap, fmt);
-        vsnprintf(buffer, BUF_SIZE, fmt, ap);
-        va_end(ap);
+    char *text = msg_buf;
+    if ((size_t) len >= room) {
+        /* Too long for the message buffer */
+        text = malloc(len + 2);
+        if (!text)
+            return;
+        vsnprintf(text, len + 1, fmt, ap);
     }
-    if (web_connfd) {
-        int len = strlen(buffer);
-        buffer[len] = '\n';
-        buffer[len + 1] = '\0';
-        web_send(web_connfd, buffer);
+    if (newline) {
+        text[len++] = '\n';
+        text[len] = '\0';
     }
+    fwrite(text, 1, len, verbfile);
+    report_text(text, len);
+    if (text != msg_buf)
+        free(text);
 }
 
-void report_noreturn(int level, char *fmt, ...)
+void report(int level, char *fmt, ...)
 {
-    if (!verbfile)
-        init_files(stdout, stdout);
+    if (level > verblevel)
+        return;
 
-    char buffer[BUF_SIZE];
-    if (level <= verblevel) {
-        va_list ap;
-        va_start(ap, fmt);
-        vfprintf(verbfile, fmt, ap);
-        fflush(verbfile);
-        va_end(ap);
+    va_list ap;
+    va_start(ap, fmt);
+    report_va(true, fmt, ap);
+    va_end(ap);
+}
 
-        if (logfile) {
-            va_start(ap, fmt);
-            vfprintf(logfile, fmt, ap);
-            fflush(logfile);
-            va_end(ap);
-        }
-        va_start(ap, fmt);
-        vsnprintf(buffer, BUF_SIZE, fmt, ap);
-        va_end(ap);
-    }
+void report_noreturn(int level, char *fmt, ...)
+{
+    if (level > verblevel)
+        return;
 
-    if (web_connfd)
-        web_send(web_connfd, buffer);
+    va_list ap;
+    va_start(ap, fmt);
+    report_va(false, fmt, ap);
+    va_end(ap);
 }
 
 /* Functions denoting failures */
@@ -163,6 +189,7 @@ void report_noreturn(int level, char *fmt, ...)
 /* Need to be able to print without using malloc */
 static void fail_fun(const char *format, const char *msg)
 {
+    report_flush();
     snprintf(fail_buf, sizeof(fail_buf), format, msg);
     /* Tack on return */
     fail_buf[strlen(fail_buf)] = '\n';
@@ -306,9 +333,7 @@ void init_time(double *timep)
 
 double delta_time(double *timep)
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    double current_time = tv.tv_sec + 1.0E-6 * tv.tv_usec;
+    double current_time = 1.0E-9 * time_ns();
     double delta = current_time - *timep;
     *timep = current_time;
     return delta;
@@ -25,6 +25,7 @@ class Debugger:
     def debug(self, program):
         return self([
             "-ex", "handle SIGALRM ignore",
+            "-ex", "handle SIGPROF ignore",
             "-ex", "run",
             program
         ])
@@ -0,0 +1,241 @@
+#!/usr/bin/env python3
+
+# Checks of qtest features beyond the queue code, kept apart from the scored
+# traces of driver.py.  Each check runs traces/features/NAME.cmd at
+# verbosity 3, with @TMP@ replaced by a fresh temporary directory, so files
+# it writes cannot collide with other runs.  The output must then match
+# NAME.expect, whose lines are:
+#
+#   # comment
+#   exit N      exit status of qtest (default 0)
+#   dump FILE   append the decoded event trace @TMP@/FILE to the output
+#   ! REGEX     pattern that no output between the previous match and the
+#               next may contain
+#   REGEX       pattern searched in the output, after the previous match
+
+import getopt
+import os
+import re
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+FEATURES = [
+    "quarantine",
+    "budget",
+    "gen",
+    "replay",
+    "compile",
+    "repeat",
+    "batch",
+    "timelimit",
+    "lightweight",
+    "bench",
+    "perf",
+    "rand",
+    "complexity",
+    "trace",
+    "time",
+]
+
+# Checks run after compiling them with 'qtest -c', which must not change
+# the output
+COMPILED = {"compile"}
+
+# Checks posted to /batch of the web server of qtest
+BATCH = {"batch"}
+
+TIMEOUT = 120
+
+# Output lines that differ from run to run
+VOLATILE = re.compile(r"^(Calibration|Time limits scaled)")
+
+
+class Checker:
+
+    featureDirectory = "./traces/features"
+    qtest = "./qtest"
+    verbose = False
+
+    def __init__(self, qtest="", verbose=False):
+        if qtest != "":
+            self.qtest = qtest
+        self.verbose = verbose
+
+    def call(self, args):
+        p = subprocess.run([self.qtest] + args, stdout=subprocess.PIPE,
+                           stderr=subprocess.STDOUT, timeout=TIMEOUT)
+        return p.returncode, p.stdout.decode(errors="replace")
+
+    def post(self, port, body):
+        for _ in range(50):
+            try:
+                s = socket.create_connection(("127.0.0.1", port))
+                break
+            except OSError:
+                time.sleep(0.1)
+        else:
+            return ""
+        s.sendall(b"POST /batch HTTP/1.1\r\nContent-Length: %d\r\n"
+                  b"Connection: close\r\n\r\n" % len(body) + body)
+        response = b""
+        while True:
+            data = s.recv(1 << 16)
+            if not data:
+                break
+            response += data
+        s.close()
+        return response.decode(errors="replace").replace("\r", "")
+
+    def runBatch(self, fname):
+        with socket.socket() as s:
+            s.bind(("127.0.0.1", 0))
+            port = s.getsockname()[1]
+        with open(fname, "rb") as f:
+            body = f.read()
+        p = subprocess.Popen([self.qtest, "-v", "3"],
+                             stdin=subprocess.PIPE, stdout=subprocess.DEVNULL,
+                             stderr=subprocess.DEVNULL)
+        response = ""
+        try:
+            p.stdin.write(b"web %d\n" % port)
+            p.stdin.flush()
+            response = self.post(port, body)
+            p.stdin.write(b"quit\n")
+            p.stdin.close()
+        except BrokenPipeError:
+            pass
+        return p.wait(timeout=TIMEOUT), response
+
+    def runCompiled(self, tmpdir, fname):
+        cname = os.path.join(tmpdir, "prog.qbc")
+        status, out = self.call(["-f", fname, "-c", cname])
+        if status != 0:
+            return status, out
+        text_status, text = self.call(["-v", "3", "-f", fname])
+        status, out = self.call(["-v", "3", "-f", cname])
+        stable = lambda s: [l for l in s.splitlines() if not VOLATILE.match(l)]
+        if status != text_status or stable(out) != stable(text):
+            out += "\nERROR: Compiled output differs from text output\n"
+            status = -1
+        return status, out
+
+    def unexpected(self, banned, lines):
+        for line in lines:
+            if any(regex.search(line) for regex in banned):
+                return "unexpected line '%s'" % line
+        return None
+
+    def matches(self, name, tmpdir, status, out):
+        expected = 0
+        lines = out.splitlines()
+        pos = 0
+        banned = []
+        path = "%s/%s.expect" % (self.featureDirectory, name)
+        patterns = []
+        if os.path.exists(path):
+            with open(path) as f:
+                patterns = [l.rstrip("\n") for l in f]
+        for pattern in patterns:
+            if not pattern or pattern.startswith("#"):
+                continue
+            if pattern.startswith("exit "):
+                expected = int(pattern[5:])
+                continue
+            if pattern.startswith("dump "):
+                dump = subprocess.run(
+                    [sys.executable,
+                     os.path.join(os.path.dirname(__file__), "tracedump.py"),
+                     os.path.join(tmpdir, pattern[5:])],
+                    stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+                lines += dump.stdout.decode(errors="replace").splitlines()
+                continue
+            if pattern.startswith("! "):
+                banned.append(re.compile(pattern[2:]))
+                continue
+            regex = re.compile(pattern)
+            start = pos
+            while pos < len(lines) and not regex.search(lines[pos]):
+                pos += 1
+            if pos == len(lines):
+                return "no line matching '%s'" % pattern
+            error = self.unexpected(banned, lines[start:pos])
+            if error:
+                return error
+            banned = []
+            pos += 1
+        error = self.unexpected(banned, lines[pos:])
+        if error:
+            return error
+        if status != expected:
+            return "exit status %d instead of %d" % (status, expected)
+        return None
+
+    def check(self, name):
+        tmpdir = tempfile.mkdtemp(prefix="qtest.")
+        try:
+            with open("%s/%s.cmd" % (self.featureDirectory, name)) as f:
+                text = f.read().replace("@TMP@", tmpdir)
+            fname = os.path.join(tmpdir, name + ".cmd")
+            with open(fname, "w") as f:
+                f.write(text)
+            if name in COMPILED:
+                status, out = self.runCompiled(tmpdir, fname)
+            elif name in BATCH:
+                status, out = self.runBatch(fname)
+            else:
+                status, out = self.call(["-v", "3", "-f", fname])
+            error = self.matches(name, tmpdir, status, out)
+        except subprocess.TimeoutExpired:
+            out, error = "", "timed out"
+        finally:
+            shutil.rmtree(tmpdir)
+        if error or self.verbose:
+            print(out)
+        if error:
+            print("---\t%s\tFAILED: %s" % (name, error))
+            return False
+        print("---\t%s\tok" % name)
+        return True
+
+    def run(self, names):
+        failed = [n for n in names if not self.check(n)]
+        if failed:
+            print("---\t%d of %d checks failed" % (len(failed), len(names)))
+            sys.exit(1)
+        print("---\tall %d checks passed" % len(names))
+
+
+def usage(name):
+    print("Usage: %s [-h] [-p PROG] [-v] [NAME ...]" % name)
+    print("  -h        Print this message")
+    print("  -p PROG   Program to test")
+    print("  -v        Show output of every check")
+    print("  NAME      Feature to check (default all): %s" %
+          ", ".join(FEATURES))
+    sys.exit(0)
+
+
+def run(name, args):
+    prog = ""
+    verbose = False
+    optlist, args = getopt.getopt(args, 'hp:v')
+    for (opt, val) in optlist:
+        if opt == '-h':
+            usage(name)
+        elif opt == '-p':
+            prog = val
+        elif opt == '-v':
+            verbose = True
+    for a in args:
+        if a not in FEATURES:
+            print("Unknown feature '%s'" % a)
+            usage(name)
+    Checker(qtest=prog, verbose=verbose).run(args or FEATURES)
+
+
+if __name__ == "__main__":
+    run(sys.argv[0], sys.argv[1:])
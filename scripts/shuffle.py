@@ -7,8 +7,7 @@ import random
 # 測試 shuffle 次數
 test_count = 1000000
 input = "new\nit 1\nit 2\nit 3\nit 4\n"
-for i in range(test_count):
-    input += "shuffle\n"
+input += "repeat %d shuffle\n" % test_count
 input += "free\nquit\n"
 
 # 取得 stdout 的 shuffle 結果
@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+
+# Decode binary event trace written by the 'trace' command of qtest
+
+import getopt
+import struct
+import sys
+
+HEADER = struct.Struct("=4sIII7Q")
+EVENT = struct.Struct("=QQIIII")
+NO_QUEUE = 0xffffffff
+
+
+def usage(name):
+    print("Usage: %s [-h] [-c] FILE" % name)
+    print("  -h  Print this message")
+    print("  -c  Write CSV instead of text")
+    sys.exit(0)
+
+
+def decode(fname, csv):
+    with open(fname, "rb") as f:
+        data = f.read()
+
+    (magic, version, event_size, names_cnt, start_ns, start_cycles, end_ns,
+     end_cycles, events, dropped, events_off) = HEADER.unpack_from(data, 0)
+    if magic != b"QTRC" or version != 1 or event_size != EVENT.size:
+        sys.exit("%s: not a trace file of known version" % fname)
+
+    names = []
+    pos = HEADER.size
+    for _ in range(names_cnt):
+        (length,) = struct.unpack_from("=H", data, pos)
+        names.append(data[pos + 2:pos + 2 + length].decode())
+        pos += 2 + length
+
+    # Convert cycles to nanoseconds since start of tracing
+    cycles = end_cycles - start_cycles
+    ns_per_cycle = (end_ns - start_ns) / cycles if cycles else 1.0
+
+    if csv:
+        print("time_ns,command,queue,size,allocs,latency_ns")
+    else:
+        print("# %d events, %d dropped, %.3f ns per cycle" %
+              (events, dropped, ns_per_cycle))
+        print("%14s  %-12s %6s %10s %7s %12s" %
+              ("time_us", "command", "queue", "size", "allocs", "latency_ns"))
+    for i in range(events):
+        start, latency, cmd, queue, size, allocs = EVENT.unpack_from(
+            data, events_off + i * EVENT.size)
+        time_ns = (start - start_cycles) * ns_per_cycle
+        name = names[cmd] if cmd < len(names) else "#%d" % cmd
+        qid = "" if queue == NO_QUEUE else str(queue)
+        if csv:
+            print("%.0f,%s,%s,%d,%d,%.0f" %
+                  (time_ns, name, qid, size, allocs, latency * ns_per_cycle))
+        else:
+            print("%14.3f  %-12s %6s %10d %7d %12.0f" %
+                  (time_ns * 1e-3, name, qid or "-", size, allocs,
+                   latency * ns_per_cycle))
+
+
+def run(name, args):
+    csv = False
+    try:
+        optlist, args = getopt.getopt(args, "hc")
+    except getopt.GetoptError as e:
+        print(e)
+        usage(name)
+    for (opt, val) in optlist:
+        if opt == "-h":
+            usage(name)
+        elif opt == "-c":
+            csv = True
+    if len(args) != 1:
+        usage(name)
+    try:
+        decode(args[0], csv)
+    except BrokenPipeError:
+        pass
+
+
+if __name__ == "__main__":
+    run(sys.argv[0], sys.argv[1:])
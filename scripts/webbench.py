@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+
+# Load generator for the web server of qtest, started with 'web [port]'
+
+import asyncio
+import getopt
+import sys
+import time
+
+
+def usage(name):
+    print("Usage: %s [-h] [-k] [-P DEPTH] [-c CONNS] [-n REQS] [-p PORT] "
+          "[PATH]" % name)
+    print("  -h        Print this message")
+    print("  -k        Keep connections alive instead of one per request")
+    print("  -P DEPTH  Pipeline DEPTH requests on kept alive connections")
+    print("  -c CONNS  Number of concurrent connections (default 100)")
+    print("  -n REQS   Total number of requests (default 10000)")
+    print("  -p PORT   Port of server (default 9999)")
+    print("  PATH      Request path (default /size)")
+    sys.exit(0)
+
+
+async def read_response(reader):
+    """Read one response, framed by its Content-Length."""
+    header = await reader.readuntil(b"\r\n\r\n")
+    if not header.startswith(b"HTTP/1.1 200"):
+        raise ConnectionError("bad response")
+    length = 0
+    for line in header.split(b"\r\n"):
+        if line.lower().startswith(b"content-length:"):
+            length = int(line[15:])
+    await reader.readexactly(length)
+
+
+async def client(port, path, reqs, keep, depth, latencies):
+    request = ("GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n" % path).encode()
+    reader = writer = None
+    while reqs > 0:
+        batch = min(depth, reqs)
+        reqs -= batch
+        start = time.perf_counter()
+        if not writer:
+            reader, writer = await asyncio.open_connection("127.0.0.1", port)
+        writer.write(request * batch)
+        for _ in range(batch):
+            await read_response(reader)
+        if not keep:
+            writer.close()
+            writer = None
+        latencies.extend([time.perf_counter() - start] * batch)
+    if writer:
+        writer.close()
+
+
+async def bench(port, path, conns, total, keep, depth):
+    latencies = []
+    per_conn = [total // conns + (i < total % conns) for i in range(conns)]
+    start = time.perf_counter()
+    await asyncio.gather(*[client(port, path, n, keep, depth, latencies)
+                           for n in per_conn if n])
+    elapsed = time.perf_counter() - start
+
+    latencies.sort()
+    cnt = len(latencies)
+    print("%d requests over %d connections in %.3f s: %.0f requests/s" %
+          (cnt, conns, elapsed, cnt / elapsed))
+    print("latency ms: p50 %.3f  p90 %.3f  p99 %.3f  max %.3f" %
+          tuple(1e3 * latencies[min(cnt - 1, int(cnt * q))]
+                for q in (0.5, 0.9, 0.99, 1.0)))
+
+
+def run(name, args):
+    conns, total, port = 100, 10000, 9999
+    keep, depth = False, 1
+    try:
+        optlist, args = getopt.getopt(args, "hkP:c:n:p:")
+    except getopt.GetoptError as e:
+        print(e)
+        usage(name)
+    for (opt, val) in optlist:
+        if opt == "-h":
+            usage(name)
+        elif opt == "-k":
+            keep = True
+        elif opt == "-P":
+            keep, depth = True, int(val)
+        elif opt == "-c":
+            conns = int(val)
+        elif opt == "-n":
+            total = int(val)
+        elif opt == "-p":
+            port = int(val)
+    path = args[0] if args else "/size"
+    asyncio.run(bench(port, path, conns, total, keep, depth))
+
+
+if __name__ == "__main__":
+    run(sys.argv[0], sys.argv[1:])
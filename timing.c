@@ -0,0 +1,66 @@
+/* Monotonic clock and calibrated cycle counter */
+
+#include <time.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#include "dudect/cpucycles.h"
+#include "timing.h"
+
+#ifdef CLOCK_MONOTONIC_RAW
+#define TIMING_CLOCK CLOCK_MONOTONIC_RAW
+#else
+#define TIMING_CLOCK CLOCK_MONOTONIC
+#endif
+
+/* Interval over which cycle counter is calibrated */
+#define CALIBRATE_NS 10000000
+
+int64_t time_ns()
+{
+    struct timespec ts;
+    clock_gettime(TIMING_CLOCK, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int64_t time_cycles()
+{
+    return cpucycles();
+}
+
+bool time_tsc_invariant()
+{
+    static int invariant = -1;
+    if (invariant < 0) {
+#if defined(__i386__) || defined(__x86_64__)
+        /* Advanced power management leaf, EDX bit 8 */
+        unsigned eax, ebx, ecx, edx;
+        invariant = __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) &&
+                    (edx & (1 << 8));
+#elif defined(__aarch64__)
+        /* Generic timer runs at fixed frequency by definition */
+        invariant = 1;
+#else
+        invariant = 0;
+#endif
+    }
+    return invariant;
+}
+
+double time_cycles_per_ns()
+{
+    static double ratio = -1;
+    if (ratio < 0) {
+        ratio = 0;
+        if (time_tsc_invariant()) {
+            int64_t start_ns = time_ns(), end_ns;
+            int64_t start = time_cycles();
+            while ((end_ns = time_ns()) - start_ns < CALIBRATE_NS)
+                ;
+            ratio = (double) (time_cycles() - start) / (end_ns - start_ns);
+        }
+    }
+    return ratio;
+}
@@ -0,0 +1,29 @@
+#ifndef LAB0_TIMING_H
+#define LAB0_TIMING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* High resolution timing.
+ *
+ * Time is read from CLOCK_MONOTONIC_RAW, which NTP neither slews nor steps.
+ * Cycles are read from the time stamp counter, or the generic timer on
+ * Arm.  When that counter ticks at a constant rate, it is calibrated
+ * against the clock so cycle counts can be converted to time.
+ */
+
+/* Nanoseconds since an arbitrary starting point */
+int64_t time_ns();
+
+/* Current value of cycle counter */
+int64_t time_cycles();
+
+/* Does cycle counter tick at a constant rate, whatever the CPU frequency? */
+bool time_tsc_invariant();
+
+/* Cycles per nanosecond, calibrated on first use.  0 without invariant
+ * counter.
+ */
+double time_cycles_per_ns();
+
+#endif /* LAB0_TIMING_H */
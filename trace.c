@@ -0,0 +1,200 @@
+/* Binary event tracing through per-thread rings */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "timing.h"
+#include "trace.h"
+
+#define RING_SIZE (1 << 14) /* Events per ring, a power of 2 */
+#define RING_MASK (RING_SIZE - 1)
+#define DRAIN_INTERVAL_NS 1000000
+
+/* Single producer, the owning thread, and single consumer, the drain.
+ * Head and tail only grow, and live on separate cache lines.
+ */
+typedef struct __ring {
+    _Alignas(64) _Atomic uint64_t head;
+    uint64_t tail_seen; /* Tail as last read by producer */
+    _Alignas(64) _Atomic uint64_t tail;
+    _Atomic uint64_t dropped;
+    struct __ring *next;
+    trace_event_t events[RING_SIZE];
+} ring_t;
+
+/* Rings are kept for the life of the program, since threads may still
+ * hold them when tracing stops.  They are reused when it starts again.
+ */
+static ring_t *rings = NULL;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread ring_t *my_ring = NULL;
+
+static atomic_bool active = false;
+static atomic_bool stopping = false;
+static pthread_t drain_thread;
+static FILE *trace_file = NULL;
+static trace_header_t header;
+
+static ring_t *new_ring()
+{
+    ring_t *r = aligned_alloc(_Alignof(ring_t), sizeof(ring_t));
+    if (!r)
+        return NULL;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    r->tail_seen = 0;
+    atomic_init(&r->dropped, 0);
+    pthread_mutex_lock(&rings_lock);
+    r->next = rings;
+    rings = r;
+    pthread_mutex_unlock(&rings_lock);
+    return r;
+}
+
+void trace_event(uint32_t cmd,
+                 uint32_t queue,
+                 uint32_t size,
+                 uint32_t allocs,
+                 uint64_t start,
+                 uint64_t latency)
+{
+    if (!atomic_load_explicit(&active, memory_order_relaxed))
+        return;
+
+    ring_t *r = my_ring;
+    if (!r && !(r = my_ring = new_ring()))
+        return;
+
+    /* Only look at the tail, written by the drain, when ring seems full */
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (head - r->tail_seen == RING_SIZE) {
+        r->tail_seen = atomic_load_explicit(&r->tail, memory_order_acquire);
+        if (head - r->tail_seen == RING_SIZE) {
+            atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+            return;
+        }
+    }
+
+    trace_event_t *ev = &r->events[head & RING_MASK];
+    ev->start = start;
+    ev->latency = latency;
+    ev->cmd = cmd;
+    ev->queue = queue;
+    ev->size = size;
+    ev->allocs = allocs;
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+/* Write out pending events of every ring.  Return number written */
+static uint64_t drain()
+{
+    uint64_t cnt = 0;
+    pthread_mutex_lock(&rings_lock);
+    ring_t *list = rings;
+    pthread_mutex_unlock(&rings_lock);
+
+    /* Rings are only ever added at the front, so the list is stable */
+    for (ring_t *r = list; r; r = r->next) {
+        uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        while (tail != head) {
+            /* Contiguous stretch up to the end of the ring */
+            size_t pos = tail & RING_MASK;
+            size_t n = head - tail;
+            if (n > RING_SIZE - pos)
+                n = RING_SIZE - pos;
+            fwrite(&r->events[pos], sizeof(trace_event_t), n, trace_file);
+            tail += n;
+            cnt += n;
+        }
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+    }
+    return cnt;
+}
+
+static void *drain_loop(void *arg)
+{
+    const struct timespec interval = {0, DRAIN_INTERVAL_NS};
+    while (!atomic_load(&stopping)) {
+        if (!drain())
+            nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+bool trace_open(const char *fname, trace_name_func_t names)
+{
+    if (trace_file)
+        trace_close();
+
+    trace_file = fopen(fname, "wb");
+    if (!trace_file)
+        return false;
+
+    /* Header is written again with final values on close */
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.event_size = sizeof(trace_event_t);
+    fwrite(&header, sizeof(header), 1, trace_file);
+    for (int id = 0; names && names(id); id++) {
+        const char *name = names(id);
+        uint16_t len = strlen(name);
+        fwrite(&len, sizeof(len), 1, trace_file);
+        fwrite(name, 1, len, trace_file);
+        header.names_cnt++;
+    }
+    header.events_off = ftell(trace_file);
+
+    /* Discard anything left over from earlier tracing */
+    pthread_mutex_lock(&rings_lock);
+    for (ring_t *r = rings; r; r = r->next) {
+        r->tail_seen = atomic_load(&r->head);
+        atomic_store(&r->tail, r->tail_seen);
+        atomic_store(&r->dropped, 0);
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    atomic_store(&stopping, false);
+    if (pthread_create(&drain_thread, NULL, drain_loop, NULL)) {
+        fclose(trace_file);
+        trace_file = NULL;
+        return false;
+    }
+    header.start_ns = time_ns();
+    header.start_cycles = time_cycles();
+    atomic_store(&active, true);
+    return true;
+}
+
+void trace_close()
+{
+    if (!trace_file)
+        return;
+
+    atomic_store(&active, false);
+    header.end_ns = time_ns();
+    header.end_cycles = time_cycles();
+    atomic_store(&stopping, true);
+    pthread_join(drain_thread, NULL);
+
+    drain();
+    for (ring_t *r = rings; r; r = r->next)
+        header.dropped += atomic_load(&r->dropped);
+
+    header.events = (ftell(trace_file) - header.events_off) /
+                    sizeof(trace_event_t);
+    rewind(trace_file);
+    fwrite(&header, sizeof(header), 1, trace_file);
+    fclose(trace_file);
+    trace_file = NULL;
+}
+
+bool trace_active()
+{
+    return atomic_load_explicit(&active, memory_order_relaxed);
+}
@@ -0,0 +1,70 @@
+#ifndef LAB0_TRACE_H
+#define LAB0_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Binary event tracing with low overhead.
+ *
+ * Each thread appends fixed-size records to its own lock-free ring, which
+ * a background thread drains to the trace file.  When a ring is full, new
+ * events are dropped and counted rather than waiting for the drain.
+ *
+ * A file starts with a trace_header_t and names_cnt names of commands,
+ * each a 16-bit length and the characters.  The records follow at
+ * events_off.  All fields are in host byte order.  Times are counted
+ * in cycles, and the header pairs cycle counts with time_ns() at start
+ * and end of tracing to convert them.  scripts/tracedump.py decodes
+ * the file.
+ */
+
+#define TRACE_MAGIC "QTRC"
+#define TRACE_VERSION 1
+
+/* Identifier of unknown queue */
+#define TRACE_NO_QUEUE UINT32_MAX
+
+typedef struct {
+    uint64_t start;   /* Cycle count at start of command */
+    uint64_t latency; /* Duration in cycles */
+    uint32_t cmd;     /* Command identifier, indexing the names */
+    uint32_t queue;   /* Identifier of current queue */
+    uint32_t size;    /* Size of current queue afterwards */
+    uint32_t allocs;  /* Allocations made by command */
+} trace_event_t;
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t event_size;
+    uint32_t names_cnt;
+    uint64_t start_ns, start_cycles;
+    uint64_t end_ns, end_cycles;
+    uint64_t events;  /* Records written */
+    uint64_t dropped; /* Records lost to full rings */
+    uint64_t events_off;
+} trace_header_t;
+
+/* Name of command with identifier, NULL when there is none */
+typedef const char *(*trace_name_func_t)(int id);
+
+/* Start tracing to file, naming the commands known so far.  Return false
+ * if it can't be created.
+ */
+bool trace_open(const char *fname, trace_name_func_t names);
+
+/* Stop tracing, write out remaining events and close file */
+void trace_close();
+
+/* Is tracing active? */
+bool trace_active();
+
+/* Append event to ring of calling thread */
+void trace_event(uint32_t cmd,
+                 uint32_t queue,
+                 uint32_t size,
+                 uint32_t allocs,
+                 uint64_t start,
+                 uint64_t latency);
+
+#endif /* LAB0_TRACE_H */
@@ -0,0 +1,13 @@
+# Test of latency percentiles from 'bench': 'q_insert_head', 'q_insert_tail', 'q_remove_head', and 'q_size'
+option fail 0
+option malloc 0
+new
+ih dolphin 100
+bench size 100
+bench it gerbil 50
+option benchjson 1
+bench ih bear 50
+bench rh 20
+option benchjson 0
+size
+free
@@ -0,0 +1,18 @@
+# Check allocation budgets: operations within them pass, and those over them are reported
+option fail 0
+option malloc 0
+new
+ih dolphin 100
+it gerbil 100
+reverse
+sort
+option ih.budget 1
+ih bear 3
+option ih.budget 2
+option new.budget 0
+new
+option new.budget 1
+free
+option sort.budget 0
+sort
+free
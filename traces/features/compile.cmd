@@ -0,0 +1,18 @@
+# Test of running a compiled trace: 'q_new', 'q_insert_head', 'q_insert_tail', 'q_remove_head', 'q_reverse', and 'q_sort'
+option fail 0
+option malloc 0
+new
+ih dolphin
+ih bear
+it gerbil
+repeat 2 {
+it meerkat
+}
+define turn {
+reverse
+}
+turn
+sort
+rh bear
+size
+free
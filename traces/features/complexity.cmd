@@ -0,0 +1,12 @@
+# Test of estimated complexity classes: 'q_insert_head', 'q_insert_tail', 'q_size', 'q_reverse', and 'q_sort'
+option fail 0
+option malloc 0
+option cxmax 16384
+complexity size
+complexity ih shuffle
+option cxmax 512
+complexity ih it reverse
+option cxmax 16384
+option malloc 100
+complexity sort
+option malloc 0
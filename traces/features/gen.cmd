@@ -0,0 +1,19 @@
+# Check keys from 'gen': order, lengths, alphabet, duplicates and prefixes, and rejected parameters
+option fail 0
+option malloc 0
+new
+gen 6 dist=sorted len=3 alphabet=2 seed=1
+free
+new
+gen 6 dist=reversed len=4 alphabet=3 seed=1
+free
+new
+gen 8 dist=zipf keys=2 len=5 seed=3
+size
+free
+new
+gen 4 prefix=3 prefixes=1 len=6 seed=1
+gen 2 order=foo
+gen 2 len=5,x
+gen 2 color=red
+free
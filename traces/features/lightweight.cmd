@@ -0,0 +1,17 @@
+# Test of lightweight allocation checks and overhead report: 'q_insert_head', 'q_insert_tail', 'q_remove_head', and 'q_free'
+option fail 0
+option malloc 0
+option lightweight 1
+new
+ih dolphin 100
+it gerbil 100
+rh dolphin
+option lightweight 0
+ih bear 100
+rt gerbil
+size
+option overhead 1
+it meerkat 10
+reverse
+option overhead 0
+free
@@ -0,0 +1,11 @@
+# Test of hardware counters around commands: 'q_insert_head', 'q_reverse', and 'q_sort'
+option fail 0
+option malloc 0
+option perf 1
+new
+ih dolphin 1000
+reverse
+sort
+ih bear 10
+option perf 0
+free
@@ -0,0 +1,16 @@
+# Check that quarantine catches a write to a freed block, and that queue operations leave no such writes
+option fail 0
+option malloc 0
+option quarantine 64
+option quarantine_kb 4
+new
+ih dolphin 50
+it gerbil 50
+rh dolphin
+rt gerbil
+sort
+dedup
+free
+uaf
+option quarantine 0
+uaf
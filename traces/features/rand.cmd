@@ -0,0 +1,36 @@
+# Test of RAND strings of given lengths and alphabet: 'q_insert_head', 'q_insert_tail', 'q_sort', and 'q_delete_dup'
+option fail 0
+option malloc 0
+option seed 7
+option randmin 3
+option randmax 8
+new
+ih RAND 6
+free
+new
+option randdist 1
+it RAND 6
+free
+new
+option randdist 2
+option alphabet 2
+option randmax 5
+ih RAND 6
+sort
+dedup
+free
+option seed 7
+option randdist 0
+option alphabet 26
+option randmax 8
+new
+ih RAND 6
+free
+option alphabet 62
+new
+ih RAND 6
+free
+option randmin 9
+option randmax 1025
+option randdist 3
+option seed 0
@@ -0,0 +1,23 @@
+# Test of repeated commands and macros: 'q_insert_head', 'q_insert_tail', 'q_remove_head', 'q_remove_tail', and 'q_sort'
+option fail 0
+option malloc 0
+new
+repeat 3 ih dolphin
+repeat 2 {
+it gerbil
+repeat 2 {
+ih bear
+}
+}
+define fill {
+ih meerkat
+it squirrel
+}
+define
+repeat 4 fill
+size
+rh meerkat
+rt squirrel
+sort
+rh bear
+free
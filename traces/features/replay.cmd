@@ -0,0 +1,25 @@
+# Test of recording commands and replaying them: 'q_new', 'q_insert_head', 'q_insert_tail', 'q_sort', and 'q_free'
+option fail 0
+option malloc 0
+record @TMP@/session.rec
+new
+ih dolphin 2
+repeat 2 {
+it gerbil
+repeat 2 {
+ih bear
+}
+}
+define fill {
+it meerkat
+}
+fill
+sort
+record
+show
+free
+replay @TMP@/session.rec
+show
+free
+replay @TMP@/session.rec 2
+show
@@ -0,0 +1,11 @@
+# Test of timed commands: 'q_insert_head', 'q_insert_tail', 'q_reverse', and 'q_size'
+option fail 0
+option malloc 0
+new
+time ih dolphin 1000
+time it gerbil 1000
+time 10 reverse
+time 100 size
+time 5 ih bear
+size
+free
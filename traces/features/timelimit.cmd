@@ -0,0 +1,24 @@
+# Test of time limits on wall and CPU time: 'q_insert_head', 'q_reverse', 'q_sort', and 'q_free'
+option fail 0
+option malloc 0
+option timelimit 1000
+option timewarn 90
+new
+ih dolphin 10000
+reverse
+sort
+option cputime 1
+it gerbil 10000
+reverse
+sort
+option cputime 0
+option timewarn 0
+free
+option timelimit 1
+new
+ih dolphin 1000000
+free
+option cputime 1
+new
+it gerbil 1000000
+free
@@ -0,0 +1,13 @@
+# Test of binary event tracing: 'q_new', 'q_insert_head', 'q_insert_tail', 'q_remove_tail', and 'q_free'
+option fail 0
+option malloc 0
+trace @TMP@/events.bin
+new
+ih dolphin 100
+it gerbil 100
+rt gerbil
+new
+ih bear
+free
+trace
+free
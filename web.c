@@ -4,16 +4,30 @@
 
 #include <arpa/inet.h> /* inet_ntoa */
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <netinet/tcp.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "timing.h"
+#include "web.h"
+
 #define LISTENQ 1024 /* second argument to listen() */
 #define MAXLINE 1024 /* max length of a line */
-#define BUFSIZE 1024
+#define BUFSIZE 8192 /* max length of a request header */
+#define MAXBODY (1 << 20)
 
 #ifndef DEFAULT_PORT
 #define DEFAULT_PORT 9999 /* use this port if none given as arg to main() */
@@ -23,58 +37,131 @@
 #define TCP_CORK TCP_NOPUSH
 #endif
 
-static int server_fd;
+/* Events handled per epoll_wait() */
+#define MAXEVENTS 64
 
-typedef struct {
-    int fd;            /* descriptor for this buf */
-    int count;         /* unread byte in this buf */
-    char *bufptr;      /* next unread byte in this buf */
-    char buf[BUFSIZE]; /* internal buffer */
-} rio_t;
+/* Pieces of output gathered per sendmsg() */
+#define MAXIOV 64
+
+/* Clients that send nothing for this long are disconnected */
+#define IDLE_TIMEOUT_SEC 10
+
+/* Longest session name */
+#define MAXSESSION 64
+
+/* Files below the working directory are served under this path */
+#define FILE_PREFIX "/files/"
+
+/* Commands posted here, one per line, run as a batch */
+#define BATCH_PATH "/batch"
+
+/* Output of a batch is sent whenever this much has piled up */
+#define BATCH_FLUSH 65536
+
+/* Body of unknown length, sent with chunked encoding */
+#define CHUNKED ((size_t) -1)
+
+int web_connfd = 0;
+
+static int server_fd = -1;
+static int epoll_fd = -1;
+static int timer_fd = -1;
+
+/* Can stdin be waited for?  Regular files can't, but are always ready */
+static bool stdin_polled = false;
+
+/* Tags of the descriptors that are not clients */
+static char stdin_tag, server_tag, timer_tag;
 
 typedef struct {
     char filename[512];
+    bool post;    /* method is POST */
+    bool range;   /* Range given */
+    bool suffix;  /* Range is the last offset bytes of file */
     off_t offset; /* for support Range */
+    bool has_end; /* last byte of Range given, as end */
     size_t end;
+    bool keep_alive;       /* connection stays open after response */
+    bool http10;           /* HTTP/1.0, which must ask to keep it open */
+    size_t content_length; /* length of body following header */
 } http_request_t;
 
-static void rio_readinitb(rio_t *rp, int fd)
-{
-    rp->fd = fd;
-    rp->count = 0;
-    rp->bufptr = rp->buf;
-}
+/* Incremental request parser.  It goes over the bytes that have arrived in
+ * the connection buffer line by line, and remembers where it stopped, so
+ * each byte is looked at once however the request is split across reads.
+ * Parts of the request are kept as offsets into the buffer, not copied.
+ */
+typedef enum { PARSE_LINE, PARSE_HEADER, PARSE_BODY, PARSE_DONE } parse_state_t;
 
-/* This is a wrapper for the Unix read() function that transfers min(n, count)
- * bytes from an internal buffer to a user buffer, where n is the number of
- * bytes requested by the user and count is the number of unread bytes in the
- * internal buffer. On entry, rio_read() refills the internal buffer via a call
- * to read() if the internal buffer is empty.
+typedef struct {
+    parse_state_t state;
+    size_t pos;                  /* end of bytes scanned */
+    size_t uri, uri_len;         /* request target */
+    size_t session, session_len; /* from query or cookie */
+    size_t body;                 /* start of body */
+    http_request_t req;
+} http_parser_t;
+
+/* Results of parsing */
+#define PARSE_ERROR -1
+#define PARSE_MORE 0 /* request incomplete, need more data */
+#define PARSE_OK 1
+
+/* Piece of output: len bytes at off in out of connection, or in file when
+ * that is not -1
  */
-/* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
-{
-    int cnt;
-    while (rp->count <= 0) { /* refill if buf is empty */
-        rp->count = read(rp->fd, rp->buf, sizeof(rp->buf));
-        if (rp->count < 0) {
-            if (errno != EINTR) /* interrupted by sig handler return */
-                return -1;
-        } else if (rp->count == 0) { /* EOF */
-            return 0;
-        } else
-            rp->bufptr = rp->buf; /* reset buffer ptr */
-    }
+typedef struct {
+    int file;
+    size_t off, len;
+} web_chunk_t;
 
-    /* Copy min(n, rp->count) bytes from internal buf to user buf */
-    cnt = n;
-    if (rp->count < n)
-        cnt = rp->count;
-    memcpy(usrbuf, rp->bufptr, cnt);
-    rp->bufptr += cnt;
-    rp->count -= cnt;
-    return cnt;
-}
+/* Client connection.  Requests are read as they arrive, without blocking,
+ * and the connection is queued while it holds complete ones, which run
+ * between console commands.
+ *
+ * Responses are built as a list of chunks, so a header can go before a
+ * body collected earlier, and files can be sent without copying.  Those
+ * of requests pipelined on the connection are sent together, by as few
+ * system calls as possible.
+ */
+typedef struct __web_conn {
+    int fd;
+    char *buf;            /* requests as they arrive */
+    size_t len, buf_size; /* bytes in buf, and its size */
+    time_t last_active;
+    bool queued;  /* waiting in ready queue, or being answered */
+    bool closing; /* close once output is sent */
+    bool confirm; /* confirm that HTTP/1.0 connection stays open */
+    char *out;    /* bytes of responses not yet sent */
+    size_t out_len, out_size;
+    web_chunk_t *chunks; /* what to send, in order */
+    int chunk_cnt, chunk_size, chunk_sent;
+    size_t chunk_off;  /* bytes of first unsent chunk already sent */
+    size_t body_start; /* offset in out of body being collected */
+    http_parser_t parser; /* of first request in buf */
+    struct __web_conn *prev, *next; /* all connections */
+    struct __web_conn *next_ready;
+} web_conn_t;
+
+static web_conn_t *conns = NULL;
+
+/* Clients with complete requests, in order of arrival */
+static web_conn_t *ready_head = NULL, **ready_tail = &ready_head;
+
+static web_conn_t *running = NULL; /* whose command is being executed */
+static char session[MAXSESSION];   /* of running request */
+
+/* Batch of commands being run.  They go one after the other, without
+ * waiting for other clients, and the output of each is sent back as a
+ * chunk of the response.
+ */
+static struct {
+    web_conn_t *conn; /* NULL when there is none */
+    char *cmds;       /* body of request */
+    char *next, *end; /* rest of commands */
+    int cnt;
+    int64_t start_ns;
+} batch;
 
 static ssize_t writen(int fd, void *usrbuf, size_t n)
 {
@@ -95,32 +182,122 @@ static ssize_t writen(int fd, void *usrbuf, size_t n)
     return n;
 }
 
-/* robustly read a text line (buffered) */
-static ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+static bool out_append(web_conn_t *c, const char *data, size_t len)
 {
-    char c, *bufp = usrbuf;
+    if (c->out_len + len > c->out_size) {
+        size_t size = c->out_size ? c->out_size : BUFSIZE;
+        while (size < c->out_len + len)
+            size *= 2;
+        char *out = realloc(c->out, size);
+        if (!out) {
+            c->closing = true;
+            return false;
+        }
+        c->out = out;
+        c->out_size = size;
+    }
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+    return true;
+}
 
-    int n;
-    for (n = 1; n < maxlen; n++) {
-        int rc;
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n')
-                break;
-        } else if (rc == 0) {
-            if (n == 1)
-                return 0; /* EOF, no data read */
-            break;        /* EOF, some data was read */
-        } else
-            return -1; /* error */
+/* Queue chunk for sending.  Adjacent bytes of out are merged */
+static void out_chunk(web_conn_t *c, int file, size_t off, size_t len)
+{
+    if (!len) {
+        if (file >= 0)
+            close(file);
+        return;
     }
-    *bufp = 0;
-    return n;
+    web_chunk_t *last = c->chunk_cnt ? &c->chunks[c->chunk_cnt - 1] : NULL;
+    if (last && file < 0 && last->file < 0 && last->off + last->len == off) {
+        last->len += len;
+        return;
+    }
+    if (c->chunk_cnt == c->chunk_size) {
+        int size = c->chunk_size ? 2 * c->chunk_size : 8;
+        web_chunk_t *chunks = realloc(c->chunks, size * sizeof(web_chunk_t));
+        if (!chunks) {
+            c->closing = true;
+            if (file >= 0)
+                close(file);
+            return;
+        }
+        c->chunks = chunks;
+        c->chunk_size = size;
+    }
+    c->chunks[c->chunk_cnt++] = (web_chunk_t){file, off, len};
+}
+
+/* Queue header of response, whose body is body_len bytes, or CHUNKED */
+static bool out_header(web_conn_t *c, const char *status, const char *type,
+                       size_t body_len, const char *extra)
+{
+    char header[512], length[64];
+    if (body_len == CHUNKED)
+        strcpy(length, "Transfer-Encoding: chunked\r\n");
+    else
+        snprintf(length, sizeof(length), "Content-Length: %zu\r\n", body_len);
+    int len = snprintf(header, sizeof(header),
+                       "HTTP/1.1 %s\r\nContent-Type: %s\r\n%s%s%s\r\n",
+                       status, type, length, extra,
+                       c->closing   ? "Connection: close\r\n"
+                       : c->confirm ? "Connection: keep-alive\r\n"
+                                    : "");
+    if (!out_append(c, header, len))
+        return false;
+    out_chunk(c, -1, c->out_len - len, len);
+    return true;
+}
+
+/* Drop output, once sent or when connection goes */
+static void out_reset(web_conn_t *c)
+{
+    for (int i = c->chunk_sent; i < c->chunk_cnt; i++) {
+        if (c->chunks[i].file >= 0)
+            close(c->chunks[i].file);
+    }
+    c->out_len = 0;
+    c->chunk_cnt = c->chunk_sent = 0;
+    c->chunk_off = 0;
 }
 
 void web_send(int out_fd, char *buf)
 {
-    writen(out_fd, buf, strlen(buf));
+    /* Output of command is the body of its response */
+    if (running && out_fd == running->fd)
+        out_append(running, buf, strlen(buf));
+    else
+        writen(out_fd, buf, strlen(buf));
+}
+
+static bool watch(int fd, void *tag)
+{
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = tag};
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+/* Register console input and a periodic timer along with the server */
+static bool loop_open()
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+        return false;
+
+    /* Regular files are not supported by epoll */
+    stdin_polled = watch(STDIN_FILENO, &stdin_tag);
+
+    /* Unlike send(), sendfile() has no way to avoid SIGPIPE from a client
+     * that went away
+     */
+    signal(SIGPIPE, SIG_IGN);
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0)
+        return false;
+    struct itimerspec period = {{1, 0}, {1, 0}};
+    timerfd_settime(timer_fd, 0, &period, NULL);
+    return watch(timer_fd, &timer_tag) && watch(server_fd, &server_tag);
 }
 
 int web_open(int port)
@@ -129,7 +306,8 @@ int web_open(int port)
     struct sockaddr_in serveraddr;
 
     /* Create a socket descriptor */
-    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenfd < 0)
         return -1;
 
     /* Eliminates "Address already in use" error from bind. */
@@ -157,16 +335,19 @@ int web_open(int port)
         return -1;
 
     server_fd = listenfd;
+    if (!loop_open())
+        return -1;
 
     return listenfd;
 }
 
-static void url_decode(char *src, char *dest, int max)
+/* Decode the len bytes of src, up to any query string */
+static void url_decode(const char *src, size_t len, char *dest, int max)
 {
-    char *p = src;
+    const char *p = src, *stop = src + len;
     char code[3] = {0};
-    while (*p && --max) {
-        if (*p == '%') {
+    while (p < stop && *p != '?' && --max) {
+        if (*p == '%' && stop - p > 2) {
             memcpy(code, ++p, 2);
             *dest++ = (char) strtoul(code, NULL, 16);
             p += 2;
@@ -177,49 +358,659 @@ static void url_decode(char *src, char *dest, int max)
     *dest = '\0';
 }
 
-static void parse_request(int fd, http_request_t *req)
-{
-    rio_t rio;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE];
-    req->offset = 0;
-    req->end = 0; /* default */
-
-    rio_readinitb(&rio, fd);
-    rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%1023s %1023s", method, uri); /* version is not cared */
-    /* read all */
-    while (buf[0] != '\n' && buf[1] != '\n') { /* \n || \r\n */
-        rio_readlineb(&rio, buf, MAXLINE);
-        if (buf[0] == 'R' && buf[1] == 'a' && buf[2] == 'n') {
-            sscanf(buf, "Range: bytes=%lu-%lu", (unsigned long *) &req->offset,
-                   (unsigned long *) &req->end);
-            /* Range: [start, end] */
-            if (req->end != 0)
-                req->end++;
+/* Look for "session=name" among the parameters in the n bytes at s */
+static void find_session(http_parser_t *p, char *buf, char *s, size_t n,
+                         char sep)
+{
+    char *end = s + n;
+    while (s < end) {
+        while (s < end && (*s == ' ' || *s == sep))
+            s++;
+        char *next = memchr(s, sep, end - s);
+        if (!next)
+            next = end;
+        if (next - s > 8 && !memcmp(s, "session=", 8)) {
+            p->session = s + 8 - buf;
+            p->session_len = next - s - 8;
         }
+        s = next;
     }
-    char *filename = uri;
-    if (uri[0] == '/') {
-        filename = uri + 1;
-        int length = strlen(filename);
-        if (length == 0) {
-            filename = ".";
-        } else {
-            for (int i = 0; i < length; ++i) {
-                if (filename[i] == '?') {
-                    filename[i] = '\0';
-                    break;
-                }
+}
+
+/* Split "METHOD URI VERSION" */
+static bool parse_request_line(http_parser_t *p, char *buf, char *line,
+                               size_t n)
+{
+    char *uri = memchr(line, ' ', n);
+    if (!uri)
+        return false;
+    uri++;
+    char *end = line + n;
+    char *version = memchr(uri, ' ', end - uri);
+    if (!version)
+        version = end;
+    p->uri = uri - buf;
+    p->uri_len = version - uri;
+    p->req.post = uri - line == 5 && !memcmp(line, "POST", 4);
+    char *query = memchr(uri, '?', version - uri);
+    if (query)
+        find_session(p, buf, query + 1, version - query - 1, '&');
+    if (version < end)
+        version++;
+    /* Persistent connections are the default since HTTP/1.1 */
+    p->req.http10 = end - version == 8 && !memcmp(version, "HTTP/1.0", 8);
+    p->req.keep_alive = !p->req.http10;
+    return true;
+}
+
+/* Is the header line of length n named name?  Return its value if so */
+static char *header_value(char *line, size_t n, const char *name)
+{
+    size_t len = strlen(name);
+    if (n <= len || line[len] != ':' || strncasecmp(line, name, len))
+        return NULL;
+    char *val = line + len + 1;
+    while (*val == ' ' || *val == '\t')
+        val++;
+    return val;
+}
+
+/* Values end at the line break, which stops strtoul */
+static void parse_header(http_parser_t *p, char *buf, char *line, size_t n)
+{
+    http_request_t *req = &p->req;
+    char *val;
+    if ((val = header_value(line, n, "Range"))) {
+        if (!strncmp(val, "bytes=", 6)) {
+            char *dash, *last;
+            req->range = true;
+            if (val[6] == '-') {
+                /* Range: bytes=-length */
+                req->suffix = true;
+                req->offset = strtoul(val + 7, NULL, 10);
+                return;
+            }
+            /* Range: bytes=start-[end], end included */
+            req->offset = strtoul(val + 6, &dash, 10);
+            if (*dash == '-') {
+                req->end = strtoul(dash + 1, &last, 10);
+                req->has_end = last > dash + 1;
             }
+            /* Invalid ranges are ignored, not refused */
+            if (req->has_end && req->end < (size_t) req->offset)
+                req->range = false;
         }
+    } else if ((val = header_value(line, n, "Connection"))) {
+        if (!strncasecmp(val, "close", 5))
+            req->keep_alive = false;
+        else if (!strncasecmp(val, "keep-alive", 10))
+            req->keep_alive = true;
+    } else if ((val = header_value(line, n, "Content-Length"))) {
+        req->content_length = strtoul(val, NULL, 10);
+    } else if ((val = header_value(line, n, "Cookie"))) {
+        /* Session given in the URL takes precedence */
+        if (!p->session_len)
+            find_session(p, buf, val, line + n - val, ';');
+    }
+}
+
+/* Continue parsing the first request in buf, of which len bytes have
+ * arrived.  Return PARSE_MORE until it is complete, with its body.
+ */
+static int parse_request(http_parser_t *p, char *buf, size_t len)
+{
+    while (p->state != PARSE_DONE) {
+        if (p->state == PARSE_BODY) {
+            if (p->req.content_length > MAXBODY)
+                return PARSE_ERROR;
+            if (len - p->body < p->req.content_length)
+                return PARSE_MORE;
+            p->pos = p->body + p->req.content_length;
+            p->state = PARSE_DONE;
+            break;
+        }
+
+        char *line = buf + p->pos;
+        char *eol = memchr(line, '\n', len - p->pos);
+        if (!eol)
+            return PARSE_MORE;
+        p->pos = eol + 1 - buf;
+        size_t n = eol - line;
+        if (n && line[n - 1] == '\r')
+            n--;
+
+        if (p->state == PARSE_LINE) {
+            /* Empty lines before a request are ignored */
+            if (!n)
+                continue;
+            if (!parse_request_line(p, buf, line, n))
+                return PARSE_ERROR;
+            p->state = PARSE_HEADER;
+        } else if (n) {
+            parse_header(p, buf, line, n);
+        } else {
+            /* End of header */
+            p->body = p->pos;
+            p->state = p->req.content_length ? PARSE_BODY : PARSE_DONE;
+        }
+    }
+    return PARSE_OK;
+}
+
+static void parser_reset(http_parser_t *p)
+{
+    memset(p, 0, sizeof(*p));
+    p->state = PARSE_LINE;
+}
+
+/* Parse what has arrived on connection */
+static int conn_parse(web_conn_t *c)
+{
+    return parse_request(&c->parser, c->buf, c->len);
+}
+
+/* Decode target of complete first request, without its leading '/', then
+ * drop the request from the buffer
+ */
+static void take_request(web_conn_t *c, http_request_t *req)
+{
+    http_parser_t *parser = &c->parser;
+    *req = parser->req;
+    const char *uri = c->buf + parser->uri;
+    size_t uri_len = parser->uri_len;
+    if (uri_len && uri[0] == '/') {
+        uri++;
+        uri_len--;
     }
-    url_decode(filename, req->filename, MAXLINE);
+    url_decode(uri, uri_len, req->filename, sizeof(req->filename));
+    if (!req->filename[0])
+        strcpy(req->filename, ".");
+    if (!req->keep_alive)
+        c->closing = true;
+    c->confirm = req->http10 && req->keep_alive;
+    c->len -= parser->pos;
+    memmove(c->buf, c->buf + parser->pos, c->len + 1);
+    parser_reset(parser);
+}
+
+static bool is_batch_request(web_conn_t *c)
+{
+    size_t len = strlen(BATCH_PATH);
+    const char *uri = c->buf + c->parser.uri;
+    return c->parser.req.post && c->parser.uri_len >= len &&
+           !memcmp(uri, BATCH_PATH, len) &&
+           (c->parser.uri_len == len || uri[len] == '?');
+}
+
+static bool is_file_request(web_conn_t *c)
+{
+    size_t len = strlen(FILE_PREFIX);
+    return c->parser.uri_len > len &&
+           !memcmp(c->buf + c->parser.uri, FILE_PREFIX, len);
 }
 
-char *web_recv(int fd, struct sockaddr_in *clientaddr)
+/* Only plain relative paths.  Hidden names, ".." among them, are refused */
+static bool safe_path(const char *path)
 {
+    if (path[0] == '/')
+        return false;
+    for (const char *p = path; p; p = strchr(p, '/')) {
+        if (*p == '/')
+            p++;
+        if (*p == '.')
+            return false;
+    }
+    return true;
+}
+
+/* Open file for reading, provided that it still lies under the working
+ * directory once symbolic links are resolved.  Return -1 otherwise.
+ */
+static int open_served(const char *path)
+{
+    char cwd[PATH_MAX], real[PATH_MAX];
+    if (!safe_path(path) || !getcwd(cwd, sizeof(cwd)) || !realpath(path, real))
+        return -1;
+
+    size_t len = strcmp(cwd, "/") ? strlen(cwd) : 0;
+    if (strncmp(real, cwd, len) || real[len] != '/')
+        return -1;
+    return open(real, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+}
+
+/* Files expose the working directory, so only local clients get them */
+static bool is_local_client(web_conn_t *c)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    return !getpeername(c->fd, (struct sockaddr *) &addr, &len) &&
+           addr.sin_family == AF_INET &&
+           (ntohl(addr.sin_addr.s_addr) >> 24) == IN_LOOPBACKNET;
+}
+
+/* Answer with status and a short plain text message */
+static void out_message(web_conn_t *c, const char *status, const char *msg)
+{
+    size_t len = strlen(msg);
+    if (out_header(c, status, "text/plain", len, "") &&
+        out_append(c, msg, len))
+        out_chunk(c, -1, c->out_len - len, len);
+}
+
+static const char *content_type(const char *path)
+{
+    static const struct {
+        const char *ext, *type;
+    } types[] = {
+        {".html", "text/html"},        {".css", "text/css"},
+        {".js", "text/javascript"},    {".json", "application/json"},
+        {".csv", "text/csv"},          {".txt", "text/plain"},
+        {".log", "text/plain"},        {".cmd", "text/plain"},
+        {".svg", "image/svg+xml"},     {".png", "image/png"},
+    };
+    const char *ext = strrchr(path, '.');
+    for (size_t i = 0; ext && i < sizeof(types) / sizeof(types[0]); i++) {
+        if (!strcmp(ext, types[i].ext))
+            return types[i].type;
+    }
+    return "application/octet-stream";
+}
+
+/* Answer request for a file.  Its data goes from the page cache straight
+ * to the socket, by sendfile()
+ */
+static void serve_file(web_conn_t *c)
+{
+    http_request_t req;
+    take_request(c, &req);
+    const char *path = req.filename + strlen(FILE_PREFIX) - 1;
+
+    if (!is_local_client(c)) {
+        out_message(c, "403 Forbidden", "Files are only served locally\n");
+        return;
+    }
+
+    struct stat st;
+    int fd = open_served(path);
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0)
+            close(fd);
+        out_message(c, "404 Not Found", "Not found\n");
+        return;
+    }
+
+    size_t size = st.st_size, start = 0, end = size;
+    char extra[128];
+    strcpy(extra, "Accept-Ranges: bytes\r\n");
+    if (req.range) {
+        if (req.suffix) {
+            size_t last = req.offset;
+            start = last < size ? size - last : 0;
+            /* No bytes at all can't be satisfied */
+            if (!last)
+                start = end;
+        } else {
+            start = req.offset;
+            if (req.has_end && req.end < size)
+                end = req.end + 1;
+        }
+        if (start >= end) {
+            close(fd);
+            snprintf(extra, sizeof(extra), "Content-Range: bytes */%zu\r\n",
+                     size);
+            out_header(c, "416 Range Not Satisfiable", "text/plain", 0,
+                       extra);
+            return;
+        }
+        snprintf(extra, sizeof(extra),
+                 "Accept-Ranges: bytes\r\nContent-Range: bytes %zu-%zu/%zu\r\n",
+                 start, end - 1, size);
+    }
+    if (out_header(c, req.range ? "206 Partial Content" : "200 OK",
+                   content_type(path), end - start, extra))
+        out_chunk(c, fd, start, end - start);
+    else
+        close(fd);
+}
+
+/* Answer requests for files at the front of buffer, which need no
+ * command.  Return result of parsing the request after them.
+ */
+static int conn_next(web_conn_t *c)
+{
+    int ret;
+    while (!c->closing && (ret = conn_parse(c)) == PARSE_OK &&
+           is_file_request(c))
+        serve_file(c);
+    return c->closing ? PARSE_MORE : ret;
+}
+
+/* Which events are wanted depends on room for input and pending output */
+static void conn_interest(web_conn_t *c)
+{
+    struct epoll_event ev = {.events = 0, .data.ptr = c};
+    if (c->len < c->buf_size - 1 && !c->closing)
+        ev.events |= EPOLLIN;
+    if (c->chunk_sent < c->chunk_cnt)
+        ev.events |= EPOLLOUT;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void conn_close(web_conn_t *c)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        conns = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    out_reset(c);
+    free(c->out);
+    free(c->chunks);
+    free(c->buf);
+    free(c);
+}
+
+static void conn_accept()
+{
+    int fd;
+    while ((fd = accept(server_fd, NULL, NULL)) >= 0) {
+        web_conn_t *c = malloc(sizeof(web_conn_t));
+        char *buf = malloc(BUFSIZE);
+        if (!c || !buf) {
+            free(c);
+            free(buf);
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        c->fd = fd;
+        c->buf = buf;
+        c->buf_size = BUFSIZE;
+        c->len = 0;
+        c->buf[0] = '\0';
+        c->last_active = time(NULL);
+        c->queued = c->closing = c->confirm = false;
+        c->out = NULL;
+        c->out_len = c->out_size = 0;
+        c->chunks = NULL;
+        c->chunk_cnt = c->chunk_size = c->chunk_sent = 0;
+        c->chunk_off = 0;
+        parser_reset(&c->parser);
+        c->prev = NULL;
+        c->next = conns;
+        if (conns)
+            conns->prev = c;
+        conns = c;
+        if (!watch(fd, c))
+            conn_close(c);
+    }
+}
+
+static void enqueue(web_conn_t *c)
+{
+    c->queued = true;
+    c->next_ready = NULL;
+    *ready_tail = c;
+    ready_tail = &c->next_ready;
+}
+
+/* Accepted sockets inherit TCP_CORK from the server, which holds back a
+ * partial segment for up to 200 ms.  Once everything is written, uncork to
+ * push out the tail, then cork again for the next batch.
+ */
+static void conn_push(web_conn_t *c)
+{
+    int optval = 0;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &optval, sizeof(optval));
+    optval = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &optval, sizeof(optval));
+}
+
+/* Send the next chunk, together with the chunks of out following it */
+static ssize_t send_chunks(web_conn_t *c)
+{
+    web_chunk_t *ch = &c->chunks[c->chunk_sent];
+    if (ch->file >= 0) {
+        off_t off = ch->off + c->chunk_off;
+        return sendfile(c->fd, ch->file, &off, ch->len - c->chunk_off);
+    }
+
+    struct iovec iov[MAXIOV];
+    size_t skip = c->chunk_off;
+    int cnt = 0;
+    for (; ch < c->chunks + c->chunk_cnt && ch->file < 0 && cnt < MAXIOV;
+         ch++) {
+        iov[cnt].iov_base = c->out + ch->off + skip;
+        iov[cnt++].iov_len = ch->len - skip;
+        skip = 0;
+    }
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = cnt};
+    return sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+}
+
+/* Send what the socket takes now.  Return false if client is gone */
+static bool conn_flush(web_conn_t *c)
+{
+    while (c->chunk_sent < c->chunk_cnt) {
+        ssize_t n = send_chunks(c);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            break;
+        if (n <= 0)
+            return false; /* or file was cut short */
+        c->chunk_off += n;
+        while (c->chunk_sent < c->chunk_cnt &&
+               c->chunk_off >= c->chunks[c->chunk_sent].len) {
+            web_chunk_t *ch = &c->chunks[c->chunk_sent++];
+            c->chunk_off -= ch->len;
+            if (ch->file >= 0)
+                close(ch->file);
+        }
+    }
+    if (c->chunk_cnt && c->chunk_sent == c->chunk_cnt) {
+        out_reset(c);
+        if (!c->closing)
+            conn_push(c);
+    }
+    return true;
+}
+
+/* Send pending output.  Close connection when done with it */
+static void conn_write(web_conn_t *c)
+{
+    if (!conn_flush(c) || (c->closing && !c->chunk_cnt))
+        conn_close(c);
+    else
+        conn_interest(c);
+}
+
+/* Read what has arrived, and queue connection once a request is complete */
+static void conn_read(web_conn_t *c)
+{
+    ssize_t n = read(c->fd, c->buf + c->len, c->buf_size - 1 - c->len);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+        return;
+    if (n <= 0) {
+        /* Send what is pending, then close */
+        c->closing = true;
+        conn_write(c);
+        return;
+    }
+    c->len += n;
+    c->buf[c->len] = '\0';
+    c->last_active = time(NULL);
+
+    int ret = conn_next(c);
+    if (ret == PARSE_MORE && c->parser.state == PARSE_BODY) {
+        /* Make room for all of body */
+        size_t size = c->parser.body + c->parser.req.content_length + 1;
+        char *buf = size > c->buf_size ? realloc(c->buf, size) : c->buf;
+        if (!buf)
+            ret = PARSE_ERROR;
+        else if (size > c->buf_size) {
+            c->buf = buf;
+            c->buf_size = size;
+        }
+    }
+    if (ret == PARSE_OK)
+        enqueue(c);
+    else if (ret == PARSE_ERROR || c->len == c->buf_size - 1)
+        conn_close(c); /* Malformed, or too large */
+    else
+        conn_write(c);
+}
+
+/* Drop clients that have been quiet too long, unless they have work */
+static void sweep_idle()
+{
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0)
+        return;
+    time_t now = time(NULL);
+    web_conn_t *c = conns;
+    while (c) {
+        web_conn_t *next = c->next;
+        if (!c->queued && !c->chunk_cnt &&
+            now - c->last_active >= IDLE_TIMEOUT_SEC)
+            conn_close(c);
+        c = next;
+    }
+}
+
+static web_conn_t *dequeue()
+{
+    web_conn_t *c = ready_head;
+    if (c) {
+        ready_head = c->next_ready;
+        if (!ready_head)
+            ready_tail = &ready_head;
+    }
+    return c;
+}
+
+/* Start batch posted in first request of connection */
+static void start_batch(web_conn_t *c)
+{
+    http_parser_t *parser = &c->parser;
+    size_t len = parser->req.content_length;
+    batch.cmds = malloc(len + 1);
+    if (batch.cmds)
+        memcpy(batch.cmds, c->buf + parser->body, len);
+
+    http_request_t req;
+    take_request(c, &req);
+    if (!batch.cmds) {
+        out_header(c, "503 Service Unavailable", "text/plain", 0, "");
+        return;
+    }
+    out_header(c, "200 OK", "text/plain", CHUNKED, "");
+    batch.conn = c;
+    batch.next = batch.cmds;
+    batch.end = batch.cmds + len;
+    batch.cnt = 0;
+    batch.start_ns = time_ns();
+}
+
+/* Frame what was output since body_start as a chunk of the response */
+static void out_http_chunk(web_conn_t *c)
+{
+    size_t len = c->out_len - c->body_start, body = c->body_start;
+    if (!len)
+        return;
+    char size[32];
+    int n = snprintf(size, sizeof(size), "%zx\r\n", len);
+    if (out_append(c, size, n) && out_append(c, "\r\n", 2)) {
+        out_chunk(c, -1, c->out_len - 2 - n, n);
+        out_chunk(c, -1, body, len);
+        out_chunk(c, -1, c->out_len - 2, 2);
+    }
+}
+
+static void conn_done(web_conn_t *c);
+
+/* Close response to batch with its timing */
+static void end_batch()
+{
+    web_conn_t *c = batch.conn;
+    double ms = (time_ns() - batch.start_ns) * 1e-6;
+    char summary[128];
+    int len = snprintf(summary, sizeof(summary),
+                       "Batch of %d commands in %.3f ms, %.0f commands/s\n",
+                       batch.cnt, ms, ms > 0 ? batch.cnt / ms * 1e3 : 0.0);
+    c->body_start = c->out_len;
+    if (out_append(c, summary, len))
+        out_http_chunk(c);
+    if (out_append(c, "0\r\n\r\n", 5))
+        out_chunk(c, -1, c->out_len - 5, 5);
+
+    free(batch.cmds);
+    batch.conn = NULL;
+    conn_done(c);
+}
+
+/* Copy next command of batch into buf.  Return its length, or 0 once the
+ * batch is done
+ */
+static int batch_next(char *buf)
+{
+    while (batch.next < batch.end) {
+        char *line = batch.next;
+        char *eol = memchr(line, '\n', batch.end - line);
+        if (!eol)
+            eol = batch.end;
+        batch.next = eol < batch.end ? eol + 1 : eol;
+        size_t len = eol - line;
+        if (len && line[len - 1] == '\r')
+            len--;
+        if (!len)
+            continue;
+        if (len > MAXLINE - 1) {
+            /* Running a cut command could do something else entirely */
+            web_conn_t *c = batch.conn;
+            char msg[96];
+            int n = snprintf(msg, sizeof(msg),
+                             "ERROR: Skipped line of %zu bytes, limit is %d\n",
+                             len, MAXLINE - 1);
+            c->body_start = c->out_len;
+            if (out_append(c, msg, n))
+                out_http_chunk(c);
+            continue;
+        }
+        memcpy(buf, line, len);
+        buf[len] = '\0';
+
+        batch.cnt++;
+        running = batch.conn;
+        web_connfd = running->fd;
+        running->body_start = running->out_len;
+        return len;
+    }
+    end_batch();
+    return 0;
+}
+
+/* Start answering first request of connection, copying its command into
+ * buf.  Return 0 if there is no command to run
+ */
+static int start_request(web_conn_t *c, char *buf)
+{
+    url_decode(c->buf + c->parser.session, c->parser.session_len, session,
+               sizeof(session));
+    if (is_batch_request(c)) {
+        start_batch(c);
+        if (batch.conn)
+            return batch_next(buf);
+        conn_done(c);
+        return 0;
+    }
+
+    running = c;
     http_request_t req;
-    parse_request(fd, &req);
+    take_request(c, &req);
 
     char *p = req.filename;
     /* Change '/' to ' ' */
@@ -228,43 +1019,110 @@ char *web_recv(int fd, struct sockaddr_in *clientaddr)
         if (*p == '/')
             *p = ' ';
     }
-    char *ret = malloc(strlen(req.filename) + 1);
-    strncpy(ret, req.filename, strlen(req.filename) + 1);
+    strncpy(buf, req.filename, strlen(req.filename) + 1);
 
-    return ret;
+    web_connfd = c->fd;
+    c->body_start = c->out_len;
+    return strlen(buf);
 }
 
-int web_eventmux(char *buf)
+const char *web_session()
 {
-    fd_set listenset;
+    return running && session[0] ? session : NULL;
+}
 
-    FD_ZERO(&listenset);
-    FD_SET(STDIN_FILENO, &listenset);
-    int max_fd = STDIN_FILENO;
-    if (server_fd > 0) {
-        FD_SET(server_fd, &listenset);
-        max_fd = max_fd > server_fd ? max_fd : server_fd;
+/* Response is complete.  Go on with what is pipelined after it, or send
+ * the responses
+ */
+static void conn_done(web_conn_t *c)
+{
+    int ret = conn_next(c);
+    if (ret == PARSE_ERROR)
+        c->closing = true;
+    if (ret == PARSE_OK) {
+        /* Pipelined request goes next, so responses share one write */
+        c->next_ready = ready_head;
+        if (!ready_head)
+            ready_tail = &c->next_ready;
+        ready_head = c;
+        return;
     }
-    int result = select(max_fd + 1, &listenset, NULL, NULL, NULL);
-    if (result < 0)
-        return -1;
+    c->queued = false;
+    conn_write(c);
+}
 
-    if (server_fd > 0 && FD_ISSET(server_fd, &listenset)) {
-        FD_CLR(server_fd, &listenset);
-        struct sockaddr_in clientaddr;
-        socklen_t clientlen = sizeof(clientaddr);
-        int web_connfd =
-            accept(server_fd, (struct sockaddr *) &clientaddr, &clientlen);
+void web_finish()
+{
+    web_conn_t *c = running;
+    if (!c)
+        return;
+    running = NULL;
+    web_connfd = 0;
 
-        char *p = web_recv(web_connfd, &clientaddr);
-        char *buffer = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\n";
-        web_send(web_connfd, buffer);
-        strncpy(buf, p, strlen(p) + 1);
-        free(p);
-        close(web_connfd);
-        return strlen(buf);
+    if (c == batch.conn) {
+        /* Stream output of batch as it piles up */
+        out_http_chunk(c);
+        if (c->out_len >= BATCH_FLUSH && !conn_flush(c)) {
+            c->closing = true;
+            batch.next = batch.end;
+        }
+        return;
     }
 
-    FD_CLR(STDIN_FILENO, &listenset);
-    return 0;
+    /* Now that the length of the body is known, put header before it */
+    size_t body_len = c->out_len - c->body_start;
+    if (out_header(c, "200 OK", "text/plain", body_len, ""))
+        out_chunk(c, -1, c->body_start, body_len);
+    conn_done(c);
+}
+
+int web_eventmux(char *buf)
+{
+    /* Finish request of previous command, if it came from the web */
+    web_finish();
+
+    /* Rest of batch goes first */
+    int len;
+    if (batch.conn && (len = batch_next(buf)) > 0)
+        return len;
+
+    struct epoll_event events[MAXEVENTS];
+    bool input = false;
+    while (true) {
+        web_conn_t *c = dequeue();
+        if (c) {
+            if ((len = start_request(c, buf)) > 0)
+                return len;
+            continue; /* Answered without command */
+        }
+        if (input)
+            return 0;
+
+        /* Unpollable input is always ready, so just look for clients */
+        int n = epoll_wait(epoll_fd, events, MAXEVENTS, stdin_polled ? -1 : 0);
+        if (n < 0 && errno != EINTR)
+            return -1;
+        input = !stdin_polled;
+        bool sweep = false;
+        for (int i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &stdin_tag)
+                input = true;
+            else if (tag == &server_tag)
+                conn_accept();
+            else if (tag == &timer_tag)
+                sweep = true; /* Later, as clients it drops may have events */
+            else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                conn_read(tag);
+            else
+                conn_write(tag);
+        }
+        if (sweep)
+            sweep_idle();
+    }
+}
+
+bool web_active()
+{
+    return server_fd >= 0;
 }
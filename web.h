@@ -1,14 +1,36 @@
 #ifndef TINYWEB_H
 #define TINYWEB_H
 
-#include <netinet/in.h>
+#include <stdbool.h>
 
+/* Socket of client whose command is being executed, 0 when none */
+extern int web_connfd;
+
+/* Listen on port.  Clients are served between console commands.  Files
+ * below the working directory are served to local clients as /files/path.
+ * Commands posted to /batch, one per line, run back to back, with their
+ * output streamed in chunks.
+ */
 int web_open(int port);
 
-char *web_recv(int fd, struct sockaddr_in *clientaddr);
+/* Is the server running? */
+bool web_active();
 
 void web_send(int out_fd, char *buffer);
 
+/* Serve clients until console input is ready, or a client request is.
+ * Return length of the request's command, copied into buf, 0 for console
+ * input and -1 on error.
+ */
 int web_eventmux(char *buf);
 
+/* Session of the request whose command is being executed, given by
+ * "session=name" in its query string or cookie.  NULL if it has none, or
+ * the command came from the console.
+ */
+const char *web_session();
+
+/* Complete response to the request whose command was executed */
+void web_finish();
+
 #endif
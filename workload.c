@@ -0,0 +1,284 @@
+/* Synthetic workload generation
+ *
+ * Keys are built as a shared prefix followed by a random suffix whose
+ * length follows a histogram.  Distinct keys are either drawn fresh or,
+ * with Zipf frequencies, from a fixed vocabulary.  A fraction of keys
+ * repeats earlier ones, and finally keys may be sorted in runs.
+ */
+
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "random.h"
+#include "report.h"
+#include "workload.h"
+
+void workload_init(workload_spec_t *spec)
+{
+    memset(spec, 0, sizeof(*spec));
+    spec->zipf_s = 1.0;
+    spec->prefixes = 1;
+    spec->alphabet = 26;
+    spec->len_cnt = 1;
+    spec->len_min[0] = 5;
+    spec->len_max[0] = 9;
+    spec->len_weight[0] = 1;
+}
+
+static bool parse_int(const char *val, int min, int *loc)
+{
+    char *end;
+    long v = strtol(val, &end, 10);
+    if (*val == '\0' || *end != '\0' || v < min || v > INT_MAX)
+        return false;
+    *loc = v;
+    return true;
+}
+
+static bool parse_double(const char *val, double min, double max, double *loc)
+{
+    char *end;
+    double v = strtod(val, &end);
+    if (*val == '\0' || *end != '\0' || !(v >= min && v <= max))
+        return false;
+    *loc = v;
+    return true;
+}
+
+/* Histogram as comma separated "len[-max][:weight]", e.g. "5-9:3,100" */
+static bool parse_lens(workload_spec_t *spec, const char *val)
+{
+    int len_min[WL_MAX_LENS], len_max[WL_MAX_LENS];
+    double len_weight[WL_MAX_LENS];
+    int cnt = 0;
+    const char *s = val;
+    while (*s) {
+        if (cnt == WL_MAX_LENS)
+            return false;
+        char *end;
+        long min = strtol(s, &end, 10), max = min;
+        if (end == s)
+            return false;
+        if (*end == '-')
+            max = strtol(end + 1, &end, 10);
+        double weight = 1;
+        if (*end == ':')
+            weight = strtod(end + 1, &end);
+        if (min < 0 || max < min || max > WL_MAX_LEN || !(weight > 0))
+            return false;
+        len_min[cnt] = min;
+        len_max[cnt] = max;
+        len_weight[cnt++] = weight;
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return false;
+        s = end;
+    }
+    if (!cnt)
+        return false;
+    /* Only a valid histogram replaces the current one */
+    memcpy(spec->len_min, len_min, sizeof(len_min));
+    memcpy(spec->len_max, len_max, sizeof(len_max));
+    memcpy(spec->len_weight, len_weight, sizeof(len_weight));
+    spec->len_cnt = cnt;
+    return true;
+}
+
+/* Named presets, refined by the parameters that follow them */
+static bool set_dist(workload_spec_t *spec, const char *val)
+{
+    if (!strcmp(val, "uniform")) {
+        spec->zipf_keys = 0;
+        spec->run = 0;
+    } else if (!strcmp(val, "zipf")) {
+        spec->zipf_keys = 1000;
+    } else if (!strcmp(val, "sorted")) {
+        spec->run = -1;
+        spec->descend = false;
+    } else if (!strcmp(val, "reversed")) {
+        spec->run = -1;
+        spec->descend = true;
+    } else if (!strcmp(val, "runs")) {
+        spec->run = 32;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* Whether key of length len is name */
+static bool key_is(const char *key, size_t len, const char *name)
+{
+    return strlen(name) == len && !strncmp(key, name, len);
+}
+
+bool workload_set(workload_spec_t *spec, const char *param)
+{
+    const char *eq = strchr(param, '=');
+    if (!eq) {
+        report(1, "Expected key=value instead of '%s'", param);
+        return false;
+    }
+    const char *key = param, *val = eq + 1;
+    size_t len = eq - param;
+
+    bool ok;
+    if (key_is(key, len, "dist"))
+        ok = set_dist(spec, val);
+    else if (key_is(key, len, "dup"))
+        ok = parse_double(val, 0, 1, &spec->dup);
+    else if (key_is(key, len, "keys"))
+        ok = parse_int(val, 0, &spec->zipf_keys);
+    else if (key_is(key, len, "s"))
+        ok = parse_double(val, 0, 10, &spec->zipf_s);
+    else if (key_is(key, len, "prefix")) {
+        int prefix_len;
+        ok = parse_int(val, 0, &prefix_len) && prefix_len <= WL_MAX_LEN;
+        if (ok)
+            spec->prefix_len = prefix_len;
+    } else if (key_is(key, len, "prefixes"))
+        ok = parse_int(val, 1, &spec->prefixes);
+    else if (key_is(key, len, "run"))
+        ok = parse_int(val, -1, &spec->run);
+    else if (key_is(key, len, "order")) {
+        ok = !strcmp(val, "asc") || !strcmp(val, "desc");
+        if (ok)
+            spec->descend = !strcmp(val, "desc");
+    } else if (key_is(key, len, "alphabet"))
+        ok = parse_int(val, 1, &spec->alphabet);
+    else if (key_is(key, len, "len"))
+        ok = parse_lens(spec, val);
+    else if (key_is(key, len, "seed")) {
+        char *end;
+        unsigned long long seed = strtoull(val, &end, 10);
+        ok = *val != '\0' && *end == '\0';
+        if (ok)
+            rand_seed(seed);
+    } else {
+        report(1, "Unknown workload parameter '%.*s'", (int) len, key);
+        return false;
+    }
+
+    if (!ok)
+        report(1, "Invalid value '%s' for workload parameter '%.*s'", val,
+               (int) len, key);
+    return ok;
+}
+
+/* Uniform double in [0, 1) */
+static double rand_unit(void)
+{
+    return rand_uint32() * (1.0 / 4294967296.0);
+}
+
+/* Pick index of weights[cnt] at random.  cdf[] holds cumulative weights */
+static int rand_pick(const double *cdf, int cnt)
+{
+    double u = rand_unit() * cdf[cnt - 1];
+    int lo = 0, hi = cnt - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cdf[mid] <= u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static char *new_key(const workload_spec_t *spec,
+                     const double *len_cdf,
+                     char **prefixes)
+{
+    char buf[2 * WL_MAX_LEN + 1];
+    int bucket = rand_pick(len_cdf, spec->len_cnt);
+    if (spec->prefix_len)
+        memcpy(buf, prefixes[rand_uint32() % spec->prefixes],
+               spec->prefix_len);
+    rand_string(buf + spec->prefix_len, spec->len_min[bucket],
+                spec->len_max[bucket], RAND_UNIFORM, spec->alphabet);
+    return strsave_or_fail(buf, "new_key");
+}
+
+static int cmp_asc(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static int cmp_desc(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) b, *(char *const *) a);
+}
+
+void workload_generate(const workload_spec_t *spec, int count, workload_t *w)
+{
+    double len_cdf[WL_MAX_LENS], sum = 0;
+    for (int i = 0; i < spec->len_cnt; i++)
+        len_cdf[i] = sum += spec->len_weight[i];
+
+    char **prefixes = NULL;
+    if (spec->prefix_len) {
+        prefixes = malloc_or_fail(spec->prefixes * sizeof(char *),
+                                  "workload_generate");
+        for (int i = 0; i < spec->prefixes; i++) {
+            prefixes[i] = malloc_or_fail(spec->prefix_len + 1,
+                                         "workload_generate");
+            rand_string(prefixes[i], spec->prefix_len, spec->prefix_len,
+                        RAND_FIXED, spec->alphabet);
+        }
+    }
+
+    int vocab = spec->zipf_keys;
+    w->count = count;
+    w->keys = malloc_or_fail((count + 1) * sizeof(char *), "workload_generate");
+    w->pool_size = vocab ? vocab : count;
+    w->pool = malloc_or_fail((w->pool_size + 1) * sizeof(char *),
+                             "workload_generate");
+    w->pool_cnt = 0;
+
+    /* Rank k of vocabulary is drawn with weight 1 / k^s */
+    double *zipf_cdf = NULL;
+    if (vocab) {
+        zipf_cdf = malloc_or_fail(vocab * sizeof(double), "workload_generate");
+        sum = 0;
+        for (int k = 0; k < vocab; k++) {
+            w->pool[w->pool_cnt++] = new_key(spec, len_cdf, prefixes);
+            zipf_cdf[k] = sum += pow(k + 1, -spec->zipf_s);
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (i > 0 && rand_unit() < spec->dup)
+            w->keys[i] = w->keys[rand_uint32() % i];
+        else if (vocab)
+            w->keys[i] = w->pool[rand_pick(zipf_cdf, vocab)];
+        else
+            w->keys[i] = w->pool[w->pool_cnt++] =
+                new_key(spec, len_cdf, prefixes);
+    }
+
+    int run = spec->run < 0 ? count : spec->run;
+    for (int i = 0; run > 1 && i < count; i += run) {
+        int n = count - i < run ? count - i : run;
+        qsort(w->keys + i, n, sizeof(char *),
+              spec->descend ? cmp_desc : cmp_asc);
+    }
+
+    if (zipf_cdf)
+        free_block(zipf_cdf, vocab * sizeof(double));
+    for (int i = 0; prefixes && i < spec->prefixes; i++)
+        free_block(prefixes[i], spec->prefix_len + 1);
+    if (prefixes)
+        free_block(prefixes, spec->prefixes * sizeof(char *));
+}
+
+void workload_free(workload_t *w)
+{
+    for (int i = 0; i < w->pool_cnt; i++)
+        free_string(w->pool[i]);
+    free_block(w->pool, (w->pool_size + 1) * sizeof(char *));
+    free_block(w->keys, (w->count + 1) * sizeof(char *));
+}
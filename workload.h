@@ -0,0 +1,48 @@
+#ifndef LAB0_WORKLOAD_H
+#define LAB0_WORKLOAD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Synthetic keys shaped like real data, for tuning sort and dedup */
+
+#define WL_MAX_LENS 16
+#define WL_MAX_LEN 4096
+
+typedef struct {
+    double dup;      /* Fraction of keys repeating an earlier key */
+    int zipf_keys;   /* Draw keys from this many with Zipf frequencies */
+    double zipf_s;   /* Exponent of Zipf distribution */
+    int prefix_len;  /* Length of prefixes shared between keys */
+    int prefixes;    /* Number of distinct shared prefixes */
+    int run;         /* Length of sorted runs, 0 unsorted, -1 all */
+    bool descend;    /* Runs are sorted in descending order */
+    int alphabet;    /* Characters taken from [a-zA-Z0-9] */
+    int len_cnt;     /* Histogram of lengths after the prefix */
+    int len_min[WL_MAX_LENS];
+    int len_max[WL_MAX_LENS];
+    double len_weight[WL_MAX_LENS];
+} workload_spec_t;
+
+typedef struct {
+    char **keys; /* Keys in insertion order, possibly repeated */
+    int count;
+    char **pool; /* Distinct strings owning the memory of keys */
+    int pool_cnt;
+    int pool_size;
+} workload_t;
+
+/* Uniform keys of 5 to 9 lowercase characters */
+void workload_init(workload_spec_t *spec);
+
+/* Set a parameter of spec from "key=value", e.g. "dup=0.3", leaving the
+ * string as it is.  Report and return false on unknown key or invalid value.
+ */
+bool workload_set(workload_spec_t *spec, const char *param);
+
+/* Generate count keys following spec */
+void workload_generate(const workload_spec_t *spec, int count, workload_t *w);
+
+void workload_free(workload_t *w);
+
+#endif /* LAB0_WORKLOAD_H */